@@ -47,6 +47,119 @@ static char* format_file_size(uint32_t bytes, char* buf, uint8_t width);
 
 // ------------------------- OLD/PGM catalog -------------------------
 
+#ifdef CONFIG_CAT_CACHE
+/*
+   Program image cache.
+   The first OLD of a catalog writes the program it sends to a file in
+   CAT_CACHE_DIR as well, named after the directory and the pattern.
+   The file starts with the directory signature from f_dirsig(), which
+   is written last, so an image that was not finished never matches.
+   A later OLD of the same catalog whose signature still matches opens
+   the cache file in place of the catalog and reads it like any other
+   program file.
+*/
+#define CAT_CACHE_DIR "/_CATALOG"
+
+static DWORD cat_sig;    // signature of the catalog opened on LUN 0
+static FIL *pgm_cache;   // cache file being written, NULL if none
+
+
+// Cache file name for a catalog, from its directory and pattern.
+static void cat_cache_name(file_t *file, char *name) {
+  DWORD key = file->dir.sclust;
+  const char *s = file->pattern;
+  uint8_t i;
+
+  if (s != (char*)NULL) {
+    while (*s)
+      key = key * 33 + (uint8_t)*s++;
+  }
+  strcpy(name, CAT_CACHE_DIR "/");
+  name += sizeof(CAT_CACHE_DIR);
+  for (i = 0; i < 8; i++) {
+    name[i] = "0123456789ABCDEF"[key >> 28];
+    key <<= 4;
+  }
+  name[8] = '\0';
+}
+
+
+// Open the cached image of a catalog, if it is still current.
+// On success, file->fp is left at the start of the image.
+static BOOL cat_cache_open(file_t *file) {
+  char name[sizeof(CAT_CACHE_DIR) + 9];
+  DWORD sig;
+  UINT read;
+
+  if (f_dirsig(&(file->dir), &cat_sig) != FR_OK) {
+    cat_sig = 0;
+    return FALSE;
+  }
+  cat_cache_name(file, name);
+  if (f_open(&fs, &(file->fp), (UCHAR*)name, FA_READ) != FR_OK)
+    return FALSE;
+  if (f_read(&(file->fp), &sig, sizeof(sig), &read) == FR_OK && read == sizeof(sig) && sig == cat_sig)
+    return TRUE;
+  f_close(&(file->fp));
+  return FALSE;
+}
+
+
+// Start writing the image of a catalog to its cache file.
+static void cat_cache_create(file_t *file) {
+  char name[sizeof(CAT_CACHE_DIR) + 9];
+  DWORD sig = 0;  // not finished yet
+  UINT written;
+
+  pgm_cache = (FIL*)NULL;
+  if (!cat_sig)
+    return;
+  if (f_mkdir(&fs, (UCHAR*)CAT_CACHE_DIR) == FR_OK) {
+    f_chmod(&fs, (UCHAR*)CAT_CACHE_DIR, AM_HID, AM_HID);
+    // the new directory changed the root, so take the signature again
+    if (f_dirsig(&(file->dir), &cat_sig) != FR_OK)
+      cat_sig = 0;
+    if (!cat_sig)
+      return;
+  }
+  cat_cache_name(file, name);
+  if (f_open(&fs, &(file->fp), (UCHAR*)name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK)
+    return;
+  if (f_write(&(file->fp), &sig, sizeof(sig), &written) != FR_OK || written != sizeof(sig)) {
+    f_close(&(file->fp));
+    return;
+  }
+  pgm_cache = &(file->fp);
+}
+
+
+// Finish the cache file, if it is still being written.
+static void cat_cache_close(void) {
+  UINT written;
+
+  if (pgm_cache == (FIL*)NULL)
+    return;
+  if (f_lseek(pgm_cache, 0) == FR_OK)
+    f_write(pgm_cache, &cat_sig, sizeof(cat_sig), &written);
+  f_close(pgm_cache);
+  pgm_cache = (FIL*)NULL;
+}
+#endif
+
+// Send part of the program, and copy it to the cache file if there is one.
+static void pgm_send(const uint8_t *data, uint8_t len) {
+  hex_send_block(data, len);
+#ifdef CONFIG_CAT_CACHE
+  UINT written;
+
+  if (pgm_cache != (FIL*)NULL
+      && (f_write(pgm_cache, data, len, &written) != FR_OK || written != len)) {
+    f_close(pgm_cache);  // the signature stays 0, so the file is not used
+    pgm_cache = (FIL*)NULL;
+  }
+#endif
+}
+
 //static const PROGMEM
 UCHAR   pgm_header[] = {0x80, 0x03};
 //static const PROGMEM
@@ -62,17 +175,18 @@ static const uint8_t PGM_STR_LEN = 26;    // length of string without terminatin
 // called once at the beginning
 void cat_open_pgm(uint16_t num_entries) {
   uint16_t i = PGM_RECORD_LEN * num_entries + PGM_HEADER_LEN;
-  hex_send_byte(pgm_header[0]);
-  hex_send_byte(pgm_header[1]);
-  hex_send_byte(i & 255);
-  hex_send_byte(i >> 8);
+  uint8_t header[PGM_HEADER_LEN];
+
+  header[0] = pgm_header[0];
+  header[1] = pgm_header[1];
+  header[2] = i & 255;
+  header[3] = i >> 8;
+  pgm_send(header, PGM_HEADER_LEN);
 }
 
 // called onece at the end
 void cat_close_pgm(void) {
-  for (uint8_t i = 0; i < sizeof(pgm_trailer); i++) {
-    hex_send_byte(pgm_trailer[i]);
-  }
+  pgm_send(pgm_trailer, sizeof(pgm_trailer));
 }
 
 // called multiple times, once for each catalog entry
@@ -82,27 +196,31 @@ void cat_write_record_pgm(uint16_t lineno, uint32_t fsize, const char* filename,
   uint8_t width = FILE_SIZE_WIDTH;
   char buf[width + 1];
   char* file_size = format_file_size(fsize, buf, width);
-
-  hex_send_word(lineno);                // line number, 2 bytes
-  hex_send_byte(PGM_LINE_LEN);          // length of next "code" line (without len. of line number), 1 byte
-  hex_send_byte(0xa0);                  // 0xa0 : token for exclamation mark, next data is comment, 1 byte
-  hex_send_byte(0xca);                  // 0xca : token for unquoted string, next data is string, 1 byte
-  hex_send_byte(PGM_STR_LEN);           // length of the string without terminating zero, 1 byte
+  uint8_t record[PGM_RECORD_LEN];
+  uint8_t *data = record;
+
+  *data++ = lineno & 255;               // line number, 2 bytes
+  *data++ = lineno >> 8;                //
+  *data++ = PGM_LINE_LEN;               // length of next "code" line (without len. of line number), 1 byte
+  *data++ = 0xa0;                       // 0xa0 : token for exclamation mark, next data is comment, 1 byte
+  *data++ = 0xca;                       // 0xca : token for unquoted string, next data is string, 1 byte
+  *data++ = PGM_STR_LEN;                // length of the string without terminating zero, 1 byte
   for (i = 0; i < width; i++) {         // file size in bytes or kiB, 5 bytes
-    hex_send_byte(file_size[i]);        //
+    *data++ = file_size[i];             //
   }                                     //
-  hex_send_byte(' ');                   // blank, 1 byte
-  hex_send_byte('\"');                  // quote, 1 byte
+  *data++ = ' ';                        // blank, 1 byte
+  *data++ = '\"';                       // quote, 1 byte
   for (i = 0; i < _MAX_LFN_LENGTH && i < namelen ; i++) { // file name padded with trailing blanks, at most _MAX_LFN_LENGTH bytes
-    hex_send_byte(filename[i]);
+    *data++ = filename[i];
   }
-  hex_send_byte('\"');                  // quote, 1 byte
+  *data++ = '\"';                       // quote, 1 byte
   for ( ; i < 17; i++) {
-    hex_send_byte(' ');
+    *data++ = ' ';
   }
-  hex_send_byte(attrib);                // file attribute, 1 byte
-  hex_send_byte(0);                     // null termination of string, 1 byte
-  // in total 33 bytes
+  *data++ = attrib;                     // file attribute, 1 byte
+  *data++ = 0;                          // null termination of string, 1 byte
+  // in total 33 bytes, sent in one go
+  pgm_send(record, PGM_RECORD_LEN);
 }
 
 uint16_t cat_file_length_pgm(uint16_t num_entries) {
@@ -125,66 +243,172 @@ uint16_t cat_max_file_length_txt(void) {
 }
 
 // Output looks like : 10.2,HELLO.PGM,F
-void cat_write_txt(uint16_t* dirnum, uint32_t fsize, const char* filename, uint8_t namelen, char attrib) {
+void cat_write_txt(uint32_t fsize, const char* filename, uint8_t namelen, char attrib) {
   uint8_t i;
   uint8_t width = FILE_SIZE_WIDTH;
   char buf[width + 1];
   char* file_size = format_file_size(fsize, buf, width);
+  uint8_t record[cat_max_file_length_txt()];
+  uint8_t *data = record;
 
-  int len = 1 + strlen(file_size) + 1 + 1 + namelen + 1 + 1; // length of data transmitted
-  hex_send_word(len);  // length
-  hex_send_byte('\"'); // because we have leading whitespaces
+  *data++ = '\"';                             // because we have leading whitespaces
   for (i = 0; i < strlen(file_size)  ; i++) { // file size in kilo bytes, 4 byte
-    hex_send_byte(file_size[i]);              //
+    *data++ = file_size[i];                   //
   }                                           //
-  hex_send_byte('\"');
-  hex_send_byte(',');                         // "," separator, 1 byte
+  *data++ = '\"';
+  *data++ = ',';                              // "," separator, 1 byte
   for (i = 0; i < namelen; i++) {    // file name , max. _MAX_LFN_LENGTH bytes
-    hex_send_byte(filename[i]);               //
+    *data++ = filename[i];                    //
   }                                           //
-  hex_send_byte(',');                         // "," separator, 1 byte
-  hex_send_byte(attrib);                      // file attribute, 1 byte
-
-  *dirnum = *dirnum - 1; // decrement dirnum, used here as entries left to detect EOF for catalog when dirnum = 0
+  *data++ = ',';                              // "," separator, 1 byte
+  *data++ = attrib;                           // file attribute, 1 byte
+  hex_send_word(data - record);               // length of data transmitted
+  hex_send_block(record, data - record);
 }
 
 // ----------------------------- common -----------------------------------
 // Return true if catalog entry shall be skipped.
-BOOL cat_skip_file(const char* filename, const char* pattern) {
+BOOL cat_skip_file(const char* filename, const char* pattern, BOOL root __attribute__((unused))) {
 	BOOL skip = FALSE;
 	if (strcmp(filename, ".") == 0 || strcmp(filename, "..") == 0) {
 		skip = TRUE;
 	}
+#ifdef CONFIG_CAT_CACHE
+	else if (root && strcmp(filename, CAT_CACHE_DIR + 1) == 0) {
+		skip = TRUE;
+	}
+#endif
 	else if (pattern != (char*)NULL) {
 		skip = (wild_cmp(pattern, filename) == 0 ? TRUE : FALSE); // skip, if pattern does not match
 	}
 	return skip;
 }
 
-// Get number of directory (=catalog) entries.
-uint16_t cat_get_num_entries(FATFS* fsp, const char* directory, const char* pattern) {
-  DIR dir;
+// Read the next directory item that belongs in the catalog.
+// If at is not NULL, it receives the directory position of that item.
+// Returns FR_NO_FILE at the end of the directory.
+static FRESULT cat_next(file_t *file, FILINFO *fno, DIR *at) {
+  FRESULT res;
+  char* filename;
+
+  do {
+# ifdef _MAX_LFN_LENGTH
+    memset(fno->lfn, 0, _MAX_LFN_LENGTH + 1);
+# endif
+    if (at != NULL)
+      *at = file->dir;
+    res = f_readdir(&file->dir, fno);             // read a directory item
+    if (res != FR_OK)
+      return res;
+    if (fno->fname[0] == 0)
+      return FR_NO_FILE;                          // end of dir
+    filename = (char*)(fno->lfn[0] != 0 ? fno->lfn : fno->fname );
+  } while (cat_skip_file(filename, file->pattern, // skip certain files like "." and ".."
+                         file->dir.sclust == (fs.fs_type == FS_FAT32 ? fs.dirbase : 0)));
+  return FR_OK;
+}
+
+#ifdef CONFIG_CAT_INDEX
+/*
+   Catalog index.
+   Counting the entries at OPEN walks the whole directory anyway, so the
+   position of every cat_step-th entry is noted on the way.  When the
+   marks run out, every other one is dropped and cat_step doubles, which
+   keeps them spread over the whole directory.  A seek starts at the
+   nearest mark and skips less than cat_step entries from there.  Only
+   the catalog opened last has marks, others seek from the start of
+   their directory.
+*/
+typedef struct _catmark_t {
+  WORD index;     // directory position, as in DIR
+  DWORD clust;
+  DWORD sect;
+} catmark_t;
+
+static file_t *cat_owner;                   // catalog the marks belong to
+static uint16_t cat_step;                   // entries between marks
+static uint8_t cat_marks;                   // marks in use
+static catmark_t cat_mark[CONFIG_CAT_INDEX];
+
+
+static void cat_index_add(uint16_t entry, DIR *at) {
+  uint8_t i;
+
+  if (entry % cat_step)
+    return;
+  if (cat_marks == CONFIG_CAT_INDEX) {
+    for (i = 0; i < (CONFIG_CAT_INDEX + 1) / 2; i++)
+      cat_mark[i] = cat_mark[i * 2];
+    cat_marks = (CONFIG_CAT_INDEX + 1) / 2;
+    cat_step *= 2;
+    if (entry % cat_step)
+      return;
+  }
+  cat_mark[cat_marks].index = at->index;
+  cat_mark[cat_marks].clust = at->clust;
+  cat_mark[cat_marks].sect = at->sect;
+  cat_marks++;
+}
+#endif
+
+// Move a catalog to entry number entry, 0 being the first one.
+// Seeking past the last entry leaves the catalog at its end.
+FRESULT cat_seek(file_t *file, uint16_t entry) {
+  FRESULT res = FR_OK;
   FILINFO fno;
 # ifdef _MAX_LFN_LENGTH
   UCHAR lfn[_MAX_LFN_LENGTH + 1];
   fno.lfn = lfn;
 #endif
+  uint16_t pos = 0;
+#ifdef CONFIG_CAT_INDEX
+  uint16_t i;
+#endif
+
+  // rewind, the start cluster does not move
+  l_opendir(file->dir.fs, file->dir.sclust, &(file->dir));
+#ifdef CONFIG_CAT_INDEX
+  if (cat_owner == file && cat_marks) {
+    i = entry / cat_step;
+    if (i >= cat_marks)
+      i = cat_marks - 1;
+    file->dir.index = cat_mark[i].index;
+    file->dir.clust = cat_mark[i].clust;
+    file->dir.sect = cat_mark[i].sect;
+    pos = i * cat_step;
+  }
+#endif
+  while (pos < entry && (res = cat_next(file, &fno, (DIR*)NULL)) == FR_OK)
+    pos++;
+  file->dirpos = pos;
+  return (res == FR_NO_FILE ? FR_OK : res);
+}
+
+// Count the catalog entries, noting positions on the way, and rewind.
+static FRESULT cat_count(file_t *file) {
   FRESULT res;
-  uint16_t count = 0;
-  char* filename;
+  FILINFO fno;
+# ifdef _MAX_LFN_LENGTH
+  UCHAR lfn[_MAX_LFN_LENGTH + 1];
+  fno.lfn = lfn;
+#endif
+  DIR at;
 
-  res = f_opendir(fsp, &dir, (UCHAR*)directory); // open the directory
-  while (res == FR_OK) {
-    res = f_readdir(&dir, &fno);                   // read a directory item
-    if (res != FR_OK || fno.fname[0] == 0)
-      break;  // break on error or end of dir
-    filename = (char*)(fno.lfn[0] != 0 ? fno.lfn : fno.fname );
-    if (cat_skip_file(filename, pattern))
-      continue; // skip certain files like "." and ".."
-    count++;
+#ifdef CONFIG_CAT_INDEX
+  cat_owner = file;
+  cat_step = 1;
+  cat_marks = 0;
+#endif
+  file->dirnum = 0;
+  while ((res = cat_next(file, &fno, &at)) == FR_OK) {
+#ifdef CONFIG_CAT_INDEX
+    cat_index_add(file->dirnum, &at);
+#endif
+    file->dirnum++;
   }
-  // no closedir needed.
-  return count;
+  if (res != FR_NO_FILE)
+    return res;
+  return cat_seek(file, 0);
 }
 
 // Return true if string matches the pattern.
@@ -271,29 +495,35 @@ void hex_read_catalog_pgm(file_t *file) {
   #endif
 
   debug_puts_P("Read PGM Catalog\r\n");
+  res = cat_seek(file, 0);                                // the whole catalog is sent, start at the top
+#ifdef CONFIG_CAT_CACHE
+  cat_cache_create(file);
+#endif
   hex_send_word(cat_file_length_pgm(file->dirnum));  // send full length of file
   cat_open_pgm(file->dirnum);
   uint16_t i = 1;
   while(i <= file->dirnum && res == FR_OK) {
-#ifdef _MAX_LFN_LENGTH
-    memset(lfn, 0, sizeof(lfn));
-#endif
-    res = f_readdir(&file->dir, &fno);                   // read a directory item
-    if (res != FR_OK || fno.fname[0] == 0)
+    res = cat_next(file, &fno, (DIR*)NULL);          // read a catalog item
+    if (res != FR_OK)
       break;  // break on error or end of dir
     filename = (char*)(fno.lfn[0] != 0 ? fno.lfn : fno.fname );
     attrib = ((fno.fattrib & AM_DIR) ? 'D' : ((fno.fattrib & AM_VOL) ? 'V' : 'F'));
     fsize = fno.fsize;
     namelen = strlen(filename);
 
-    if (cat_skip_file(filename, file->pattern))
-      continue; // skip certain files like "." and ".."
-
     debug_trace(filename, 0, namelen);
 
     cat_write_record_pgm(i++, fsize, filename, namelen, attrib);
   }
   cat_close_pgm();
+#ifdef CONFIG_CAT_CACHE
+  if (res == FR_OK)
+    cat_cache_close();
+  else if (pgm_cache != (FIL*)NULL) {
+    f_close(pgm_cache);  // short image, leave it unfinished
+    pgm_cache = (FIL*)NULL;
+  }
+#endif
   //debug_putc('>');
   rc = HEXSTAT_SUCCESS;
   hex_send_byte( rc ); // status byte transmit
@@ -314,37 +544,20 @@ void hex_read_catalog_txt(file_t * file) {
   uint32_t size;
 
   debug_puts_P("Read TXT Catalog\r\n");
-  // the loop is to be able to skip files that shall not be listed in the catalog
-  // else we only go through the loop once
-  do {
-# ifdef _MAX_LFN_LENGTH
-    memset(lfn, 0, sizeof(lfn));
-# endif
-    res = f_readdir(&file->dir, &fno); // read a directory item
-    if (res != FR_OK) {
-      break; // break on error, leave do .. while loop
-    }
-    filename = (char*)(fno.lfn[0] != 0 ? fno.lfn : fno.fname );
-    namelen = strlen(filename);
-    attrib = ((fno.fattrib & AM_DIR) ? 'D' : ((fno.fattrib & AM_VOL) ? 'V' : 'F'));
-    size = fno.fsize;
-    if (filename[0] == 0) {
-      res = FR_NO_FILE; // OK  to set this ?
-      break;  // break on end of dir, leave do .. while loop
-    }
-
-    if (cat_skip_file(filename, file->pattern))
-      continue; // skip certain files like "." and "..", next do .. while
-    break; // success, leave the do .. while loop
-  } while(1);
+  res = cat_next(file, &fno, (DIR*)NULL); // read the next catalog item
 
   switch(res) {
     case FR_OK:
+      filename = (char*)(fno.lfn[0] != 0 ? fno.lfn : fno.fname );
+      namelen = strlen(filename);
+      attrib = ((fno.fattrib & AM_DIR) ? 'D' : ((fno.fattrib & AM_VOL) ? 'V' : 'F'));
+      size = fno.fsize;
       debug_trace(filename, 0, namelen);
 
       // write the calatog entry for OPEN/INPUT
       // TODO can the below have a bad return code?
-      cat_write_txt(&(file->dirnum), size, filename, namelen, attrib);
+      cat_write_txt(size, filename, namelen, attrib);
+      file->dirpos++;  // entries read, EOF for catalog when dirpos = dirnum
       rc = HEXSTAT_SUCCESS;
       break;
     case FR_NO_FILE:
@@ -373,6 +586,8 @@ void hex_open_catalog(file_t *file, uint8_t lun, uint8_t att, char* path) {
   } else {
     if(file != NULL) {
       file->attr |= FILEATTR_CATALOG;
+      if (att & OPENMODE_RELATIVE)
+        file->attr |= FILEATTR_RELATIVE; // INPUT #n, REC r reads entry r
       // remove the leading $
       char* string = path;
       /* this will force the root directory to be read
@@ -405,13 +620,23 @@ void hex_open_catalog(file_t *file, uint8_t lun, uint8_t att, char* path) {
       // if not the root slash, remove slash from dirpath
       if (strlen(dirpath) > 1 && dirpath[strlen(dirpath) - 1] == '/')
         dirpath[strlen(dirpath) - 1] = '\0';
-      // get the number of catalog entries from dirpath that match the pattern
-      file->dirnum = cat_get_num_entries(&fs, dirpath, pattern);
       if (pattern != (char*)NULL)
         file->pattern = pattern; // store pattern, will be freed in free_lun
-      // the file size is either the length of the PGM file for OLD/PGM or the max. length of the txt file for OPEN/INPUT.
-      fsize = (lun == 0 ? cat_file_length_pgm(file->dirnum)  : cat_max_file_length_txt());
       res = f_opendir(&fs, &(file->dir), (UCHAR*)dirpath); // open the director
+#ifdef CONFIG_CAT_CACHE
+      if (res == FR_OK && lun == 0 && cat_cache_open(file)) {
+        // the program is cached, from here on it is read like a normal file
+        file->attr = 0;
+        fsize = (uint16_t)(file->fp.fsize - sizeof(DWORD));
+      } else
+#endif
+      {
+        // get the number of catalog entries from dirpath that match the pattern
+        if (res == FR_OK)
+          res = cat_count(file);
+        // the file size is either the length of the PGM file for OLD/PGM or the max. length of the txt file for OPEN/INPUT.
+        fsize = (lun == 0 ? cat_file_length_pgm(file->dirnum)  : cat_max_file_length_txt());
+      }
     } else {
       // too many open files.
       rc = HEXSTAT_MAX_LUNS;
@@ -431,13 +656,8 @@ void hex_open_catalog(file_t *file, uint8_t lun, uint8_t att, char* path) {
     }
   }
   if(rc == HEXSTAT_SUCCESS) {
-    if(!hex_is_bav()) { // we can send response
-      hex_send_word(4);    // claims it is accepted buffer length, but looks to really be my return buffer length...
-      hex_send_word(fsize);
-      hex_send_word(0);
-      hex_send_byte(HEXSTAT_SUCCESS);    // status code
-      hex_finish();
-    }
+    // the leading length claims it is accepted buffer length, but looks to really be my return buffer length...
+    hex_send_size_response(fsize, 0);
   } else {
     hex_send_final_response( rc );
   }
@@ -26,5 +26,6 @@
 void hex_read_catalog_pgm(file_t* file);
 void hex_read_catalog_txt(file_t* file);
 void hex_open_catalog(file_t *file, uint8_t lun, uint8_t att, char* path);
+FRESULT cat_seek(file_t *file, uint16_t entry);
 
 #endif /* SRC_CATALOG_H */
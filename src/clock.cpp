@@ -117,7 +117,7 @@ static void clk_read(pab_t *pab) {
   debug_puts_P("Read RTC\r\n");
 
   if(pab->lun == LUN_CMD) {
-    hex_read_status();
+    hex_read_status(pab);
     return;
   }
 
@@ -154,19 +154,8 @@ static void clk_read(pab_t *pab) {
   } else {
     rc = HEXSTAT_NOT_OPEN;
   }
-  if ( rc == HEXSTAT_SUCCESS ) {
-    if ( !hex_is_bav() ) {
-      len = (len > pab->buflen) ? pab->buflen : len;
-      hex_send_word( len );
-      for ( i = 0; i < len; i++ ) {
-        hex_send_byte( buffer[ i ] );
-      }
-      hex_send_byte( rc );
-      hex_finish();
-    }
-  } else {
-    hex_send_final_response( rc );
-  }
+  len = (len > pab->buflen) ? pab->buflen : len;
+  hex_send_response( len, buffer, rc );
 }
 
 
@@ -261,13 +250,14 @@ void clk_reset() {
    Command handling registry for device
 */
 
-static const cmd_op_t ops[] PROGMEM = {
-                                        {HEXCMD_OPEN,            clk_open},
-                                        {HEXCMD_CLOSE,           clk_close},
-                                        {HEXCMD_READ,            clk_read},
-                                        {HEXCMD_WRITE,           clk_write},
-                                        {HEXCMD_RESET_BUS,       clk_reset_dev},
-                                        {(hexcmdtype_t)HEXCMD_INVALID_MARKER,  NULL}
+static const cmd_proc ops[] PROGMEM = {
+                                        NULL,          // HEXCMD_NULL
+                                        clk_reset_dev, // HEXCMD_RESET_BUS
+                                        clk_open,      // HEXCMD_OPEN
+                                        clk_close,     // HEXCMD_CLOSE
+                                        NULL,          // HEXCMD_DELETE_OPEN
+                                        clk_read,      // HEXCMD_READ
+                                        clk_write      // HEXCMD_WRITE
                                       };
 
 static uint8_t is_cfg_valid(void) {
@@ -281,7 +271,7 @@ void clk_register(void) {
   if(is_cfg_valid()) {
     clk_dev = _config.clk_dev;
   }
-  reg_add(DEV_RTC_START, clk_dev, DEV_RTC_END, ops);
+  reg_add(DEV_RTC_START, clk_dev, DEV_RTC_END, ops, REG_OPS_LEN(ops));
 }
 
 
@@ -45,6 +45,7 @@
 #define FLASH_MEM_DATA  1
 
 #include <avr/io.h>
+#include <avr/power.h>
 
 #ifdef ARDUINO
 #  if defined ARDUINO_AVR_UNO || defined ARDUINO_AVR_PRO || defined ARDUINO_AVR_NANO
@@ -243,6 +244,12 @@ static inline void pwr_irq_disable(void) {
 #    define CONFIG_RTC_DSRTC
 //#    define CONFIG_RTC_SOFTWARE
 #    define CONFIG_SD_AUTO_RETRIES 10
+//#    define CONFIG_SD_STREAMING
+#    define CONFIG_HEXBUS_TIMING
+#    define CONFIG_REL_INDEX 8
+#    define CONFIG_IDLE_TASKS
+#    define CONFIG_FF_FREE_RUNS 4
+#    define CONFIG_CAT_INDEX 8
 
 // Debug to serial
 //#define CONFIG_UART_DEBUG
@@ -430,6 +437,45 @@ static inline void timer_config(void) {
 
 #endif
 
+#if (defined CONFIG_HEXBUS_IRQ || defined CONFIG_IDLE_TASKS) && !defined HSK_HANDLER
+
+/* HSK is on PD3 (INT1) on all hardware variants */
+static inline void hsk_irq_enable(void) {
+  EICRA = (EICRA & ~_BV(ISC10)) | _BV(ISC11);  // trigger on falling HSK
+  EIFR  = _BV(INTF1);                           // drop edges seen while polling
+  EIMSK |= _BV(INT1);
+}
+
+static inline void hsk_irq_disable(void) {
+  EIMSK &= ~_BV(INT1);
+}
+
+#define HSK_HANDLER ISR(INT1_vect)
+
+#endif
+
+#if defined CONFIG_HEXBUS_TIMING && !defined HEX_CAL_TIMER
+
+/* Timer 1 free runs at F_CPU/8 while the bus timing is calibrated */
+/* (pwr_init() powers it down, so it is only powered while in use) */
+static inline void cal_timer_start(void) {
+  power_timer1_enable();
+  TCCR1A = 0;
+  TCCR1B = _BV(CS11);
+}
+
+static inline void cal_timer_stop(void) {
+  TCCR1B = 0;
+#ifdef INCLUDE_POWERMGMT
+  power_timer1_disable();
+#endif
+}
+
+#define HEX_CAL_TIMER     TCNT1
+#define HEX_CAL_PRESCALE  8
+
+#endif
+
 static inline void leds_init(void) {
   LED_BUSY_DDR |= LED_BUSY_PIN;
 }
@@ -0,0 +1,3 @@
+#ifndef ARDUINO
+   #include "crc.cpp"
+#endif
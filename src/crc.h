@@ -35,16 +35,28 @@ extern "C"{
 #endif
 
 #include <util/crc16.h>
+#include <avr/pgmspace.h>
 
 uint8_t crc7update(uint8_t crc, uint8_t data);
 
-#define crc_xmodem_update(crc, data) _crc_xmodem_update(crc, data)
+#ifdef CONFIG_SD_CRC_TABLE
+/* Table-driven version, faster but 512 bytes larger */
+extern const uint16_t crc_xmodem_table[256] PROGMEM;
+
+static inline uint16_t crc_xmodem_table_update(uint16_t crc, uint8_t data) {
+  return (crc << 8) ^ pgm_read_word(&crc_xmodem_table[(crc >> 8) ^ data]);
+}
+
+#  define crc_xmodem_update(crc, data) crc_xmodem_table_update(crc, data)
+#else
+#  define crc_xmodem_update(crc, data) _crc_xmodem_update(crc, data)
+#endif
 #define crc16_update(crc, data) _crc16_update(crc, data)
 
 /* Calculate a CRC over a block of data - more efficient if inlined */
 static inline uint16_t crc_xmodem_block(uint16_t crc, const uint8_t *data, unsigned int length) {
   while (length--) {
-    crc = _crc_xmodem_update(crc, *data++);
+    crc = crc_xmodem_update(crc, *data++);
   }
   return crc;
 }
@@ -167,4 +167,32 @@ DRESULT disk_getinfo(BYTE drv, BYTE page, void *buffer) {
 }
 
 
+#ifdef CONFIG_SD_STREAMING
+/* Only SD cards support streamed transfers */
+DRESULT disk_stream_open(BYTE drv, DWORD sector, BYTE write) {
+  switch(drv >> DRIVE_BITS) {
+#ifdef HAVE_SD
+  case DISK_TYPE_SD:
+    return sd_stream_open(drv & DRIVE_MASK,sector,write);
+#endif
+
+  default:
+    return RES_ERROR;
+  }
+}
+
+BYTE disk_stream_get(void) {
+  return sd_stream_get();
+}
+
+void disk_stream_put(BYTE data) {
+  sd_stream_put(data);
+}
+
+DRESULT disk_stream_close(void) {
+  return sd_stream_close();
+}
+#endif
+
+
 #endif
@@ -79,8 +79,16 @@ DSTATUS disk_initialize (BYTE);
 DSTATUS disk_status (BYTE);
 DRESULT disk_read (BYTE, BYTE*, DWORD, BYTE);
 DRESULT disk_write (BYTE, const BYTE*, DWORD, BYTE);
+DRESULT disk_sync (BYTE);
 #define disk_ioctl(a,b,c) RES_OK
 DRESULT disk_getinfo(BYTE drv, BYTE page, void *buffer);
+#ifdef CONFIG_SD_STREAMING
+/* Streamed single-sector transfers, one byte at a time */
+DRESULT disk_stream_open(BYTE drv, DWORD sector, BYTE write);
+BYTE    disk_stream_get(void);
+void    disk_stream_put(BYTE data);
+DRESULT disk_stream_close(void);
+#endif
 
 void disk_init(void);
 
@@ -89,6 +97,23 @@ enum diskstates { DISK_OK = 0, DISK_CHANGED, DISK_REMOVED, DISK_ERROR };
 
 extern volatile enum diskstates disk_state;
 
+#ifdef CONFIG_SD_STATS
+/* SD card statistics, latencies in log2 buckets of timer 0 counts */
+#define DISK_STAT_BUCKETS    10
+
+enum diskstatops { DISK_STAT_READ = 0, DISK_STAT_WRITE, DISK_STAT_BUSY,
+                   DISK_STAT_INIT, DISK_STAT_OPS };
+
+typedef struct {
+  uint16_t hist[DISK_STAT_OPS][DISK_STAT_BUCKETS];
+  uint16_t crc_errors;    /* bad data CRCs and rejected commands or blocks */
+  uint16_t timeouts;      /* card did not answer within 500ms */
+  uint16_t errors;        /* changes of disk_state to DISK_ERROR */
+} diskstats_t;
+
+extern diskstats_t disk_stats;
+#endif
+
 /* Disk type - part of the external API except for ATA2! */
 #define DISK_TYPE_ATA        0
 #define DISK_TYPE_ATA2       1
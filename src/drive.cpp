@@ -80,6 +80,97 @@ static file_t* find_lun(uint8_t lun) {
 }
 
 
+#ifdef CONFIG_REL_INDEX
+/*
+   Record index for relative files.
+   Records sit at buflen * record, so the offset is cheap to find, but
+   f_lseek() walks the cluster chain from the start of the file as soon
+   as the target leaves the current cluster.  Each entry remembers which
+   cluster holds one cluster-sized span of an open file, so going back
+   to any record in a span seen before takes a single sector load.
+   Entries are recycled round robin and dropped when their file slot is
+   handed out again.
+*/
+typedef struct _recidx_t {
+  file_t *file;   // owner, NULL if unused
+  DWORD base;     // file offset where the span starts
+  DWORD clust;    // cluster holding the span
+} recidx_t;
+
+static recidx_t rec_index[CONFIG_REL_INDEX];
+static uint8_t rec_next;
+
+
+static void rec_index_drop(file_t *file) {
+  uint8_t i;
+
+  for (i = 0; i < CONFIG_REL_INDEX; i++) {
+    if (rec_index[i].file == file)
+      rec_index[i].file = NULL;
+  }
+}
+
+
+static FRESULT seek_record(file_t *file, DWORD ofs) {
+  FRESULT res;
+  DWORD csize;
+  DWORD base;
+  uint8_t i;
+
+  if (!ofs)
+    return f_lseek(&(file->fp), 0);
+  // span holding the byte before ofs, as FatFs tracks the position
+  csize = (DWORD)file->fp.fs->csize * 512;
+  base = ((ofs - 1) / csize) * csize;
+  for (i = 0; i < CONFIG_REL_INDEX; i++) {
+    if (rec_index[i].file == file && rec_index[i].base == base)
+      return f_lseek_clust(&(file->fp), ofs, rec_index[i].clust);
+  }
+  res = f_lseek(&(file->fp), ofs);
+  if (res == FR_OK && file->fp.fptr == ofs) {
+    rec_index[rec_next].file = file;
+    rec_index[rec_next].base = base;
+    rec_index[rec_next].clust = file->fp.curr_clust;
+    rec_next = (rec_next + 1) % CONFIG_REL_INDEX;
+  }
+  return res;
+}
+#else
+#define rec_index_drop(file)    do {} while(0)
+#define seek_record(file, ofs)  f_lseek(&((file)->fp), ofs)
+#endif
+
+#ifdef CONFIG_IDLE_TASKS
+/*
+   Idle work.
+   Written data stays in the FatFs window until something else needs
+   the window, and the directory entry and FSInfo are only brought up
+   to date on CLOSE.  Once the bus has been quiet for IDLE_SYNC_DELAY,
+   files with pending data are synced, so a card pulled without a CLOSE
+   loses less.  The delay keeps a run of PRINT# records in the window.
+   The file last read from is read ahead right away, so its next sector
+   is loaded before the host asks for it.  A card still programming the
+   last write is waited for here, not at the next command.  With no files
+   open at all, the FAT is searched for free clusters.
+*/
+#define IDLE_SYNC_DELAY (HZ / 2)
+
+static file_t *read_ahead;  // file to read ahead for, NULL if none
+static tick_t sync_time;    // pending writes are synced after this
+static uint8_t sync_card;   // the card may still be programming a write
+
+#define idle_read(file)   do { read_ahead = (file); } while(0)
+#define idle_write()      do { sync_time = getticks() + IDLE_SYNC_DELAY; sync_card = TRUE; } while(0)
+#define idle_flushed()    do { sync_card = TRUE; } while(0)
+#define idle_drop(file)   do { if (read_ahead == (file)) read_ahead = NULL; } while(0)
+#else
+#define idle_read(file)   do {} while(0)
+#define idle_write()      do {} while(0)
+#define idle_flushed()    do {} while(0)
+#define idle_drop(file)   do {} while(0)
+#endif
+
+
 static file_t* reserve_lun(uint8_t lun) {
   uint8_t i;
 
@@ -89,6 +180,7 @@ static file_t* reserve_lun(uint8_t lun) {
       files[i].lun = lun;
       files[i].file.pattern = (char*)NULL;
       files[i].file.attr = 0; // ensure clear attr before use
+      rec_index_drop(&(files[i].file));
       open_files++;
       set_busy_led(TRUE);
       return &(files[i].file);
@@ -104,6 +196,7 @@ static void free_lun(uint8_t lun) {
   for (i = 0; i < MAX_OPEN_FILES; i++) {
     if (files[i].used && files[i].lun == lun) {
       files[i].used = FALSE;
+      idle_drop(&(files[i].file));
       if (files[i].file.pattern != (char*) NULL)
         free(files[i].file.pattern);
       open_files--;
@@ -115,57 +208,67 @@ static void free_lun(uint8_t lun) {
 }
 
 /**
- * Get the size of the next value stored in INTERNAL format.
+ * Read the next value of a DISPLAY or INTERNAL file into buffer.
+ * A DISPLAY record ends at the first LF outside of quotes, CRs outside
+ * of quotes are dropped and the LF itself is consumed.  An INTERNAL value
+ * is a length byte followed by that many bytes, and is kept whole,
+ * length byte included.  Each byte is looked at once, in place in the
+ * FatFs file window.  If the value holds more than max bytes, only max
+ * are taken and the rest is left for the next read.
  */
-static uint16_t next_value_size_internal(file_t* file) {
-  // if data stored in INTERNAL format send next value
-  uint16_t read;    // how many bytes are read
-  uint8_t val_len;  // length of next value
-  uint32_t val_ptr; // start position in file
-  uint8_t res;      // read result
-
-
-  val_ptr= file->fp.fptr;
-  res = f_read(&(file->fp), &val_len, 1, &read);
-  f_lseek(&(file->fp), val_ptr);
-  return (res == FR_OK ? val_len + 1 : 0);
-}
-
-/**
- * Get the size of the next record in DISPLAY format.
- * Search for the trailing LF (\r\n) and ignore a CR (\r) before the LF.
- */
-static uint16_t next_value_size_display(file_t* file) {
-  BYTE res;
-  UINT read;
-  char token;
+static FRESULT read_value(file_t* file, uint16_t max, uint16_t *len) {
+  FRESULT res;
+  const BYTE *data;
+  UINT avail;
+  UINT used;
+  uint8_t ch;
   uint8_t instr = FALSE;
-  int val_len = 0;
-  uint32_t val_ptr;
+  uint8_t done = FALSE;
+  uint16_t value = 0;   // INTERNAL bytes left in the value, 0 = not started
+  uint8_t *out = buffer;
 
-  val_ptr = file->fp.fptr; // save the current position for to restore
-  res = f_read(&(file->fp), &token, 1, &read);
-  while (res == FR_OK && read == 1) {
-    if ((token == '\n') && !instr){ // stop on first trailing delimiter
-      break;
+  do {
+    res = f_read_window(&(file->fp), &data, (UINT)-1, &avail);
+    if (res != FR_OK || !avail)
+      break;  // error or end of file
+    used = 0;
+    if (file->attr & FILEATTR_DISPLAY) {
+      while (used < avail) {
+        ch = data[used];
+        if (ch == '\n' && !instr) { // stop on first trailing delimiter
+          used++;
+          done = TRUE;
+          break;
+        }
+        if (ch != '\r' || instr) {
+          if (!max) {
+            done = TRUE;
+            break;
+          }
+          *out++ = ch;
+          max--;
+        }
+        if (ch == '\"')
+          instr = !instr;
+        used++;
+      }
+    } else {
+      if (!value)
+        value = data[0] + 1;
+      used = (avail < value ? avail : value);
+      if (used > max)
+        used = max;
+      memcpy(out, data, used);
+      out += used;
+      max -= used;
+      value -= used;
+      done = (!value || !max);
     }
-    if ((token != '\r') || instr) val_len++;
-    if (token == '\"') instr = !instr;
-    res = f_read(&(file->fp), &token, 1, &read);
-  }
-  res = f_lseek(&(file->fp), val_ptr); // re-position the file pointer
-  return (res == FR_OK ? val_len : 0);
-}
-
-/**
- * Get the size of the next stored value.
- */
-static uint16_t next_value_size(file_t* file) {
-  if (file->attr & FILEATTR_DISPLAY) {
-    return next_value_size_display(file);
-  } else {
-    return next_value_size_internal(file);
-  }
+    if (used < avail)
+      res = f_unread_window(&(file->fp), avail - used);
+  } while (!done && res == FR_OK);
+  *len = out - buffer;
+  return res;
 }
 
 static hexstatus_t fresult2hexstatus(FRESULT fr) {
@@ -284,7 +387,9 @@ typedef enum _diskcmd_t {
   DISK_CMD_RMDIR,
   DISK_CMD_RENAME,
   DISK_CMD_COPY,
-  DISK_CMD_PWD
+  DISK_CMD_PWD,
+  DISK_CMD_BENCH,
+  DISK_CMD_STATS
 } diskcmd_t;
 
 static const action_t dcmds[] MEM_CLASS = {
@@ -302,9 +407,103 @@ static const action_t dcmds[] MEM_CLASS = {
                                   {DISK_CMD_COPY,     "cp"},
                                   {DISK_CMD_COPY,     "copy"},
                                   {DISK_CMD_PWD,      "pwd"},
+#ifdef CONFIG_SD_BENCH
+                                  {DISK_CMD_BENCH,    "bench"},
+#endif
+#ifdef CONFIG_SD_STATS
+                                  {DISK_CMD_STATS,    "stats"},
+#endif
                                   {DISK_CMD_NONE,     ""}
                                 };
 
+#ifdef CONFIG_SD_BENCH
+/*
+   Read benchmark.
+   "BENCH <file>" reads the whole file through the FatFs window, sector
+   by sector the way LOAD does, and notes the size and the time taken.
+   The next read of the command channel returns them as "<bytes> B <ms>
+   MS", so builds with different SD transfer and CRC options can be
+   compared on the same card.
+*/
+static DWORD bench_bytes;
+static tick_t bench_ticks;
+static uint8_t bench_ready;
+
+
+static FRESULT drv_bench(char *path) {
+  FIL fp;
+  FRESULT res;
+  const BYTE *data;
+  UINT read;
+  tick_t start;
+
+  res = f_open(&fs, &fp, (UCHAR*)path, FA_READ);
+  if (res != FR_OK)
+    return res;
+  bench_bytes = 0;
+  start = getticks();
+  do {
+    res = f_read_window(&fp, &data, 512, &read);
+    bench_bytes += read;
+  } while (res == FR_OK && read);
+  bench_ticks = getticks() - start;
+  f_close(&fp);
+  bench_ready = (res == FR_OK);
+  return res;
+}
+
+
+static uint8_t bench_report(uint8_t *buf) {
+  char *s = (char *)buf;
+
+  bench_ready = FALSE;
+  ultoa(bench_bytes, s, 10);
+  strcat_P(s, PSTR(" B "));
+  ultoa((uint32_t)bench_ticks * (1000 / HZ), s + strlen(s), 10);
+  strcat_P(s, PSTR(" MS"));
+  return strlen(s);
+}
+#endif
+
+#ifdef CONFIG_SD_STATS
+/*
+   SD card statistics.
+   "STATS" makes the next five reads of the command channel return the
+   counters kept by the SD driver, one line each: the read, write,
+   busy-wait and init latency histograms as "R", "W", "B" and "I"
+   followed by the number of operations in each log2 bucket of timer 0
+   counts (0-1, 2-3, 4-7, ... 512 and up), then "CRC <n> TMO <n>
+   ERR <n>" for CRC errors, timeouts and DISK_ERROR transitions.
+   "STATS CLEAR" sets them all to zero.
+*/
+static uint8_t stats_line;   // next line to report, plus one (0 if none)
+
+
+static uint8_t stats_report(uint8_t *buf) {
+  char *s = (char *)buf;
+  uint8_t i, op = stats_line - 1;
+
+  if (op < DISK_STAT_OPS) {
+    s[0] = pgm_read_byte(&PSTR("RWBI")[op]);
+    s[1] = 0;
+    for (i = 0; i < DISK_STAT_BUCKETS; i++) {
+      strcat_P(s, PSTR(" "));
+      utoa(disk_stats.hist[op][i], s + strlen(s), 10);
+    }
+    stats_line++;
+  } else {
+    strcpy_P(s, PSTR("CRC "));
+    utoa(disk_stats.crc_errors, s + strlen(s), 10);
+    strcat_P(s, PSTR(" TMO "));
+    utoa(disk_stats.timeouts, s + strlen(s), 10);
+    strcat_P(s, PSTR(" ERR "));
+    utoa(disk_stats.errors, s + strlen(s), 10);
+    stats_line = 0;
+  }
+  return strlen(s);
+}
+#endif
+
 static inline hexstatus_t drv_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
   hexstatus_t rc = HEXSTAT_SUCCESS;
   diskcmd_t cmd;
@@ -350,6 +549,19 @@ static inline hexstatus_t drv_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
       }
     }
     break;
+#ifdef CONFIG_SD_BENCH
+  case DISK_CMD_BENCH:
+    res = drv_bench(buf);
+    break;
+#endif
+#ifdef CONFIG_SD_STATS
+  case DISK_CMD_STATS:
+    if (!strcasecmp_P(buf, PSTR("clear")))
+      memset(&disk_stats, 0, sizeof(disk_stats));
+    else
+      stats_line = 1;
+    break;
+#endif
   case DISK_CMD_COPY:
   case DISK_CMD_PWD:
     //populate error string with cwd.
@@ -403,6 +615,52 @@ static void drv_write_cmd(pab_t *pab, uint8_t *dev) {
 }
 
 
+#ifdef CONFIG_SD_STREAMING
+static UINT stream_taken;   // bytes taken off the bus by drv_stream_write()
+
+/*
+   drv_stream_write() -
+   move one sector from the bus straight onto the card.  Each
+   byte is clocked out over SPI while the next one is handshaked
+   in, so no sector buffer is needed.
+*/
+static DRESULT drv_stream_write(BYTE drv, DWORD sect) {
+  DRESULT res;
+
+  stream_taken += 512;
+  res = disk_stream_open(drv, sect, TRUE);
+  if (res != RES_OK) {
+    // the host sends the data regardless, take it off the bus
+    hex_recv_discard(512);
+    return res;
+  }
+  if (hex_recv_stream(disk_stream_put, 512) != HEXERR_SUCCESS) {
+    disk_stream_close(); // card discards the partial sector
+    return RES_ERROR;
+  }
+  return disk_stream_close();
+}
+
+
+/*
+   drv_stream_read() -
+   move one sector from the card straight onto the bus.  The SPI
+   transfer of the next byte runs while the current one sits in
+   the bus hold windows, hiding the card behind bus timing.
+*/
+static DRESULT drv_stream_read(BYTE drv, DWORD sect) {
+  DRESULT res;
+
+  res = disk_stream_open(drv, sect, FALSE);
+  if (res == RES_OK) {
+    hex_send_stream(disk_stream_get, 512);
+    res = disk_stream_close();
+  }
+  return res;
+}
+#endif
+
+
 /*
    drv_write() -
    writes data to the open file associated with the LUN number
@@ -415,7 +673,9 @@ static void drv_write(pab_t *pab) {
   uint16_t i;
   uint16_t header = 0;
   uint8_t  first_buffer = 1;
+  uint8_t  eol = 0;
   UINT written;
+  DWORD zeroed;
   file_t* file = NULL;
   FRESULT res = FR_OK;
   
@@ -434,19 +694,34 @@ static void drv_write(pab_t *pab) {
   res = (file != NULL ? FR_OK : FR_NO_FILE);
   if (res == FR_OK && (file->attr & FILEATTR_RELATIVE)){
     // if we're not at the right record position, reposition
-    if (file->fp.fsize < pab->buflen * pab->record) {
+    if (file->fp.fsize < (DWORD)pab->buflen * pab->record) {
       // file is too small.  Enlarge.
-      // TODO make this more efficient by handling in 256 byte chunks...
       res = f_lseek( &(file->fp), file->fp.fsize );
-      buffer[0] = 0;
-      for (i = file->fp.fsize; i < pab->buflen * pab->record; i++)
-        res = f_write(&(file->fp), buffer, 1, &written);
+      if (res == FR_OK)
+        res = f_write_zero(&(file->fp), (DWORD)pab->buflen * pab->record - file->fp.fsize, &zeroed);
     }  else // file is big enough, just find the right spot.
-      res = f_lseek(&(file->fp), pab->buflen * pab->record);
+      res = seek_record(file, (DWORD)pab->buflen * pab->record);
   }
   // OK, read the data we need to send to the file
   while (len && rc == HEXSTAT_SUCCESS && res == FR_OK ) {
     i = (len >= BUFSIZE ? BUFSIZE : len);
+#ifdef CONFIG_SD_STREAMING
+    if (file != NULL && (pab->lun != 0 || !first_buffer)) {
+      if (len >= 512 && !((uint16_t)file->fp.fptr & 511)) {
+        // whole sectors left, move them from the bus to the card directly
+        stream_taken = 0;
+        res = f_write_stream(&(file->fp), len & ~511U, &written, drv_stream_write);
+        if (res == FR_OK && written != (len & ~511U)) {
+          res = FR_DENIED;
+        }
+        len -= stream_taken;
+        continue;
+      }
+      // stop at the next sector boundary, so the rest can be streamed
+      if (i > 512 - ((uint16_t)file->fp.fptr & 511))
+        i = 512 - ((uint16_t)file->fp.fptr & 511);
+    }
+#endif
     rc = hex_get_data(buffer, i);
     if ((pab->lun == 0) && (first_buffer == 1)) {
       header = (buffer[0] | ( buffer[1] << 8 )) & 0xffdf;
@@ -457,11 +732,18 @@ static void drv_write(pab_t *pab) {
       first_buffer = 0;
     }
     if (file != NULL && res == FR_OK && rc == HEXSTAT_SUCCESS) {
-
+      len -= i;
+      if (!len && (file->attr & FILEATTR_DISPLAY) && (header == 0) && i < BUFSIZE) {
+        // last piece of a DISPLAY record, write the CRLF along with it
+        buffer[i++] = 13;
+        buffer[i++] = 10;
+        eol = 1;
+      }
       res = f_write(&(file->fp), buffer, i, &written);
       if ( written != i ) {
         res = FR_DENIED;
       }
+      continue;
     }
     len -= i;
   }
@@ -470,33 +752,38 @@ static void drv_write(pab_t *pab) {
     if ( !fs_initialized ) {
       rc = HEXSTAT_DEVICE_ERR;
     }
-    // TODO what error should we return to caller?
+    if (rc == HEXSTAT_SUCCESS)
+      rc = fresult2hexstatus(res);
     hex_eat_it( len, rc );
     return;
   }
 
   // if in DISPLAY mode
   if (file != NULL && (file->attr & FILEATTR_DISPLAY) && (header == 0)) {
-	// add CRLF to data (for DISPLAY mode)
-    buffer[0] = 13;
-    buffer[1] = 10;
     len = 2;
-    res = f_write(&(file->fp), buffer, 2, &written);
-    if (!res) {
-      debug_trace(buffer, 0, written);
-    }
-    if (written != 2) {
-      rc = HEXSTAT_BUF_SIZE_ERR;  // generic error.
+    if (!eol) {
+      // add CRLF to data (for DISPLAY mode)
+      buffer[0] = 13;
+      buffer[1] = 10;
+      res = f_write(&(file->fp), buffer, 2, &written);
+      if (!res) {
+        debug_trace(buffer, 0, written);
+      }
+      if (written != 2) {
+        rc = HEXSTAT_BUF_SIZE_ERR;  // generic error.
+      }
     }
   }
   if (file != NULL && (file->attr & FILEATTR_RELATIVE)) {
-    buffer[0] = 0;
-    for (i = pab->datalen + 1 + len; i <= pab->buflen; i++)
-      res = f_write(&(file->fp), buffer, 1, &written);
+    // pad the record out to its full length
+    if (pab->buflen > pab->datalen + len)
+      res = f_write_zero(&(file->fp), pab->buflen - pab->datalen - len, &zeroed);
   }
   if (rc == HEXSTAT_SUCCESS) {
     rc = fresult2hexstatus(res);
   }
+  if (file != NULL)
+    idle_write();
 
   hex_send_final_response( rc );
 }
@@ -524,10 +811,8 @@ static void drv_write(pab_t *pab) {
 
 static void drv_read(pab_t *pab) {
   hexstatus_t rc;
-  uint8_t i;
-  uint16_t len;
   uint16_t fsize;
-  char token;
+  const BYTE *data;
   UINT read;
   FRESULT res = FR_OK;
   file_t* file;
@@ -535,7 +820,19 @@ static void drv_read(pab_t *pab) {
   debug_puts_P("Read File\r\n");
 
   if(pab->lun == LUN_CMD || pab->lun == _cmd_lun) {
-    hex_read_status();
+#ifdef CONFIG_SD_BENCH
+    if (bench_ready) {
+      hex_send_response(bench_report(buffer), buffer, HEXSTAT_SUCCESS);
+      return;
+    }
+#endif
+#ifdef CONFIG_SD_STATS
+    if (stats_line) {
+      hex_send_response(stats_report(buffer), buffer, HEXSTAT_SUCCESS);
+      return;
+    }
+#endif
+    hex_read_status(pab);
     return;
   }
 
@@ -548,72 +845,81 @@ static void drv_read(pab_t *pab) {
     }
     else {
       debug_putc('T');
+      if ((file->attr & FILEATTR_RELATIVE) && pab->record != file->dirpos)
+        cat_seek(file, pab->record);
       hex_read_catalog_txt(file);
       return;
     }
   }
   if ((file != NULL) && (file->attr & FILEATTR_RELATIVE))
-    f_lseek(&(file->fp), pab->buflen * pab->record);
+    seek_record(file, (DWORD)pab->buflen * pab->record);
   if (file != NULL) {
     if ( (uint16_t)file->fp.fptr < file->fp.fsize ) {
       fsize = file->fp.fsize - (uint16_t)file->fp.fptr; // amount of data in file that can be sent.
-      if (fsize != 0 && pab->lun != 0 && pab->lun != LUN_RAW) { // for 'normal' files (lun > 0 && lun < 254) send data value by value
-        // amount of data for next value to be sent
-        if (file->attr & FILEATTR_RELATIVE) 
-          if (file->attr & FILEATTR_DISPLAY) 
-            fsize = next_value_size(file);
-          else
-            fsize = pab->buflen;
-        else  
-          fsize = next_value_size(file); // TODO maybe rename fsize to something like send_size
-      }
-      else if (pab->lun == 0)
-        fsize = pab->buflen;
-      if (res == FR_OK) {
-        if ( fsize == 0 ) {
-          rc = HEXSTAT_EOF;
-        } else {
-          // size of buffer provided by host (amount to send)
-          if ( fsize > pab->buflen ) {
-            fsize = pab->buflen;
-          }
+      if (pab->lun != 0 && pab->lun != LUN_RAW
+          && ((file->attr & FILEATTR_DISPLAY) || !(file->attr & FILEATTR_RELATIVE))) {
+        // for 'normal' files (lun > 0 && lun < 254) send data value by value.
+        // The value is scanned into buffer, which is then sent as is.
+        res = read_value(file, (pab->buflen > BUFSIZE ? BUFSIZE : pab->buflen), &fsize);
+        if (res != FR_OK)
+          fsize = 0;
+        rc = (hex_send_word( fsize ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
+        if (fsize && rc == HEXSTAT_SUCCESS) {
+          debug_trace(buffer, 0, fsize);
+          rc = (hex_send_block(buffer, fsize) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
+        }
+        fsize = 0;
+      } else {
+        if (pab->lun != LUN_RAW)
+          fsize = pab->buflen;
+        // size of buffer provided by host (amount to send)
+        if ( fsize > pab->buflen ) {
+          fsize = pab->buflen;
         }
+        if ((uint16_t)file->fp.fptr + fsize >= file->fp.fsize)
+          fsize = file->fp.fsize - (uint16_t)file->fp.fptr;
+        // send how much we are going to send
+        rc = (hex_send_word( fsize ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
       }
-      if ((uint16_t)file->fp.fptr + fsize >= file->fp.fsize)
-        fsize = file->fp.fsize - (uint16_t)file->fp.fptr;
-      // send how much we are going to send
-      rc = (hex_send_word( fsize ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
-      len = 1; // send data immediately byte by byte to avoid time-out errors
-      // while we have data remaining to send.
+      // while we have data remaining to send.  Data goes out in runs
+      // straight from the file window, so the host never waits longer
+      // than one sector load between bytes.
       while ( fsize && rc == HEXSTAT_SUCCESS && res == FR_OK) {
-        /*
-        len = fsize;    // remaining amount to read from file
-        // will it fit into buffer or not?  Only read as much
-        // as we can hold in our buffer.
-        len = ( len > BUFSIZE ) ? BUFSIZE : len;
-        */
-        res = f_read(&(file->fp), buffer, len, &read);
-        if (!res) {
-          debug_trace(buffer, 0, read);
+#ifdef CONFIG_SD_STREAMING
+        if (fsize >= 512 && !((uint16_t)file->fp.fptr & 511)) {
+          // whole sectors left, move them from the card to the bus directly
+          res = f_read_stream(&(file->fp), fsize & ~511U, &read, drv_stream_read);
+          fsize -= read;
+          continue;
+        }
+#endif
+        res = f_read_window(&(file->fp), &data, fsize, &read);
+        if (FR_OK == res && !read) {
+          res = FR_RW_ERROR; // file is shorter than it claims
         }
         if (FR_OK == res) {
-          for (i = 0; i < read; i++) {
-            rc = (hex_send_byte(buffer[i]) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
-          }
+          debug_trace((void *)data, 0, read);
+          rc = (hex_send_block(data, read) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
         }
         fsize -= read;
       }
+      // the host expects the length sent above, pad it if reading failed
+      if (fsize && rc == HEXSTAT_SUCCESS) {
+        memset(buffer, 0, BUFSIZE);
+        while (fsize && rc == HEXSTAT_SUCCESS) {
+          read = (fsize > BUFSIZE ? BUFSIZE : fsize);
+          rc = (hex_send_block(buffer, read) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
+          fsize -= read;
+        }
+      }
 
       if(rc == HEXSTAT_SUCCESS)
         rc = fresult2hexstatus(res);
       if(rc == HEXSTAT_SUCCESS) {
-        if (file->attr & FILEATTR_DISPLAY) {
-          res = f_read(&(file->fp), &token, 1, &read); // skip (CR)LF
-          if (token == '\r')
-            res = f_read(&(file->fp), &token, 1, &read);
-          if (file->attr & FILEATTR_RELATIVE)
-            f_lseek(&(file->fp), pab->buflen * (pab->record + 1));
-        }
+        // read_value() has already consumed the (CR)LF
+        if ((file->attr & (FILEATTR_DISPLAY | FILEATTR_RELATIVE)) == (FILEATTR_DISPLAY | FILEATTR_RELATIVE))
+          seek_record(file, (DWORD)pab->buflen * (pab->record + 1));
+        idle_read(file);
       }
     }
     else {
@@ -825,6 +1131,7 @@ static void drv_close(pab_t *pab) {
   if (file != NULL) {
     if(!(file->attr & FILEATTR_CATALOG)) {
       res = f_close(&(file->fp));
+      idle_flushed();
     }
     free_lun(pab->lun);
     rc = fresult2hexstatus(res);
@@ -863,8 +1170,7 @@ static void drv_restore( pab_t *pab ) {
   if ( rc == HEXSTAT_SUCCESS ) {
     // If we are restore on an open directory...rewind to start
     if ( file->attr & FILEATTR_CATALOG ) {
-      //file->fp.rewindDirectory();
-      rc = HEXSTAT_UNSUPP_CMD;
+      rc = fresult2hexstatus(cat_seek(file, (file->attr & FILEATTR_RELATIVE) ? pab->record : 0));
     } else {
       // if we are a normal file, rewind to starting position.
       f_lseek(&(file->fp),  0 ); // restore back to start of file.
@@ -963,19 +1269,14 @@ static void drv_status( pab_t *pab ) {
         }
       }
       else { // FILEATTR_CATALOG
-        if (file->dirnum == 0) {
+        if (file->dirpos >= file->dirnum) {
           st |= FILE_EOF_REACHED;
         }
       }
     }
   }
   if ( pab->buflen >= 1 ) {
-    if ( !hex_is_bav() ) {
-      hex_send_word( 1 );
-      hex_send_byte( st );
-      hex_send_byte( HEXSTAT_SUCCESS );
-      hex_finish();
-    }
+    hex_send_response( 1, &st, HEXSTAT_SUCCESS );
   } else {
     hex_send_final_response( HEXSTAT_BUF_SIZE_ERR );
   }
@@ -997,18 +1298,22 @@ static void drv_reset_dev( __attribute__((unused)) pab_t *pab) {
 /*
    Command handling registry for device
 */
-static const cmd_op_t ops[] PROGMEM = {
-                                        {HEXCMD_OPEN, drv_open},
-                                        {HEXCMD_CLOSE, drv_close},
-                                        {HEXCMD_DELETE_OPEN, drv_delete_open},
-                                        {HEXCMD_READ, drv_read},
-                                        {HEXCMD_WRITE, drv_write},
-                                        {HEXCMD_RESTORE, drv_restore},
-                                        {HEXCMD_RETURN_STATUS, drv_status},
-                                        {HEXCMD_DELETE, drv_delete},
-                                        {HEXCMD_VERIFY, drv_verify},
-                                        {HEXCMD_RESET_BUS, drv_reset_dev},
-                                        {(hexcmdtype_t)HEXCMD_INVALID_MARKER, NULL}
+static const cmd_proc ops[] PROGMEM = {
+                                        NULL,            // HEXCMD_NULL
+                                        drv_reset_dev,   // HEXCMD_RESET_BUS
+                                        drv_open,        // HEXCMD_OPEN
+                                        drv_close,       // HEXCMD_CLOSE
+                                        drv_delete_open, // HEXCMD_DELETE_OPEN
+                                        drv_read,        // HEXCMD_READ
+                                        drv_write,       // HEXCMD_WRITE
+                                        drv_restore,     // HEXCMD_RESTORE
+                                        drv_delete,      // HEXCMD_DELETE
+                                        drv_status,      // HEXCMD_RETURN_STATUS
+                                        NULL,            // HEXCMD_SVC_REQ_ENABLE
+                                        NULL,            // HEXCMD_SVC_REQ_DISABLE
+                                        NULL,            // HEXCMD_SVC_REQ_POLL
+                                        NULL,            // HEXCMD_MASTER
+                                        drv_verify       // HEXCMD_VERIFY
                                       }; // end of table.
 
 
@@ -1018,7 +1323,7 @@ void drv_register(void) {
   if(_config.valid) {
     drv_dev = _config.drv_dev;
   }
-  reg_add(DEV_DRV_START, drv_dev, DEV_DRV_END, ops);
+  reg_add(DEV_DRV_START, drv_dev, DEV_DRV_END, ops, REG_OPS_LEN(ops));
   disk_init();
   //debug_puts_P("Drive Function on device #");
   //debug_putdec(drv_dev);
@@ -1049,6 +1354,52 @@ void drv_reset( void )
 }
 
 
+#ifdef CONFIG_IDLE_TASKS
+/*
+   drv_idle() -
+   do one piece of idle work.  Returns IDLE_MORE if there is more to
+   do, so the main loop stays awake and checks the bus before asking
+   for the next piece, or IDLE_WAIT if the next piece is not due yet,
+   so it can sleep until the next tick.
+*/
+uint8_t drv_idle(void) {
+  uint8_t i;
+  FIL *fp = NULL;
+
+  if (!fs_initialized)
+    return IDLE_DONE;
+  if (sync_card) {
+    sync_card = FALSE;
+    disk_sync(fs.drive);
+  }
+  if (read_ahead != NULL) {
+    f_prefetch(&(read_ahead->fp));
+    read_ahead = NULL;
+    return IDLE_MORE;
+  }
+  for (i = 0; i < MAX_OPEN_FILES && fp == NULL; i++) {
+    if (files[i].used && !(files[i].file.attr & FILEATTR_CATALOG)
+        && (files[i].file.fp.flag & (FA__WRITTEN | FA__ERROR)) == FA__WRITTEN)
+      fp = &(files[i].file.fp);
+  }
+  if (fp == NULL) {
+#if _USE_FREE_RUNS
+    // with nothing open, look for free clusters so the next SAVE finds them at once
+    if (!open_files && f_scanfree(&fs))
+      return IDLE_MORE;
+#endif
+    return IDLE_DONE;
+  }
+  if (time_before(getticks(), sync_time))
+    return IDLE_WAIT;
+  if (f_sync(fp) != FR_OK)
+    fp->flag |= FA__ERROR;  // CLOSE reports it
+  sync_card = TRUE;
+  return IDLE_MORE;
+}
+#endif
+
+
 void drv_init(void) {
   uint8_t i;
 
@@ -36,7 +36,8 @@ typedef struct _file_t {
   FIL fp;
   DIR dir;
   uint8_t attr;
-  uint16_t dirnum;
+  uint16_t dirnum;   // catalog entries
+  uint16_t dirpos;   // catalog entries read so far
   char* pattern;
 } file_t;
 
@@ -48,14 +49,21 @@ typedef struct _luntbl_t {
 } luntbl_t;
 
 
+/* drv_idle() results */
+#define IDLE_DONE       0   // nothing left to do
+#define IDLE_MORE       1   // more to do right away
+#define IDLE_WAIT       2   // more to do at a later tick
+
 #ifdef INCLUDE_DRIVE
 void drv_reset(void);
 void drv_register(void);
 void drv_init(void);
+uint8_t drv_idle(void);
 #else
 #define drv_reset()     do {} while(0)
 #define drv_register()  do {} while(0)
 #define drv_init()      do {} while(0)
+#define drv_idle()      IDLE_DONE
 #endif
 
 #endif /* DRIVE_H */
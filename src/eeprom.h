@@ -73,6 +73,11 @@ typedef struct config_s {
   uint8_t     prn_dev;
   printcfg_t  prn;
 #endif
+#ifdef CONFIG_HEXBUS_TIMING
+  uint8_t     hex_timing;   // hextiming_t profile
+  uint8_t     hex_hold;     // calibrated HSK hold time in us
+  uint8_t     hex_release;  // calibrated line release time in us
+#endif
 } config_t;
 
 extern config_t _config;
@@ -78,15 +78,21 @@ BYTE LFN_pos[13]={1,3,5,7,9,14,16,18,20,22,24,28,30};
 #endif
 
 #if _USE_1_BUF != 0
-# define FSBUF static_buf
+# define FSBUF static_buf[0]
 static
-BUF static_buf;
+BUF static_buf[_CACHE_SLOTS];
 #else
 # define FSBUF (fs->buf)
 #endif
 
-#if _USE_FS_BUF != 0
+#if _CACHE_SLOTS > 1
+# define FPBUF (*fp_buf)
+# define FP_SLOT 1      /* First slot for file data, FAT and directory use slot 0 */
+static
+BUF *fp_buf = &static_buf[FP_SLOT];   /* Data slot last moved to */
+#elif _USE_FS_BUF != 0
 # define FPBUF FSBUF
+# define FP_SLOT 0
 #else
 # define FPBUF (fp->buf)
 #endif
@@ -119,9 +125,17 @@ BOOL move_window (      /* TRUE: successful, FALSE: failed */
 #if !_FS_READONLY
     BYTE n;
     if (buf->dirty) {                   /* Write back dirty window if needed */
-      if (disk_write(ofs->drive, buf->data, wsect, 1) != RES_OK)
+      if (disk_write(ofs->drive, buf->data, wsect, 1) != RES_OK) {
+#if _USE_FS_BUF != 0
+        if (buf->owner)                 /* Fail the file the data belongs to, */
+          buf->owner->flag |= FA__ERROR; /* even if someone else flushed it */
+#endif
         return FALSE;
+      }
       buf->dirty = FALSE;
+#if _USE_FS_BUF != 0
+      buf->owner = NULL;
+#endif
       if (wsect < (ofs->fatbase + ofs->sects_fat)) {  /* In FAT area */
         for (n = ofs->n_fats; n >= 2; n--) {          /* Reflect the change to FAT copy */
           wsect += ofs->sects_fat;
@@ -157,18 +171,129 @@ BOOL move_fs_window(
 
 
 
+#if _CACHE_SLOTS > 1
+static
+BUF* pick_fp_window (   /* Find the data slot holding a sector, or the one to recycle for it */
+  FATFS *fs,
+  DWORD sector
+)
+{
+  BUF *buf, *hit = NULL, *old = &static_buf[FP_SLOT];
+
+
+  for (buf = &static_buf[FP_SLOT]; buf < &static_buf[_CACHE_SLOTS]; buf++) {
+    if (buf->sect == sector && buf->fs == fs) hit = buf;
+    if (old->sect && (!buf->sect || buf->age > old->age))
+      old = buf;                                      /* First empty slot, else the oldest */
+    if (buf->age < 255) buf->age++;
+  }
+  buf = (hit ? hit : old);
+  buf->age = 0;
+  return buf;
+}
+#endif
+
+
+
+
 static
 BOOL move_fp_window(
   FIL* fp,
   DWORD  sector
 )
 {
+#if _CACHE_SLOTS > 1
+  BUF *buf;
+
+  if (!sector) {                      /* Write back every dirty slot */
+    for (buf = static_buf; buf < &static_buf[_CACHE_SLOTS]; buf++) {
+      if (!move_window(fp->fs,buf,0)) return FALSE;
+    }
+    return TRUE;
+  }
+  fp_buf = pick_fp_window(fp->fs,sector);
+#endif
   return move_window(fp->fs,&FPBUF,sector);
 }
 
 
 
 
+#if !_FS_READONLY && _USE_1_BUF != 0
+static
+void drop_fp_window (   /* Forget data sectors that are about to be written around the window */
+  FATFS *fs,
+  DWORD sect,
+  UINT cnt
+)
+{
+  BUF *buf;
+
+
+  for (buf = &static_buf[FP_SLOT]; buf < &static_buf[_CACHE_SLOTS]; buf++) {
+    if (buf->fs == fs && buf->sect - sect < cnt)
+      buf->sect = 0;
+  }
+}
+#else
+#define drop_fp_window(fs, sect, cnt)
+#endif
+
+
+
+
+#if !_FS_READONLY && _USE_FS_BUF != 0
+static
+void release_fp_window (  /* Disown window data of a file that is going away */
+  FIL *fp
+)
+{
+#if _USE_1_BUF != 0
+  BUF *buf;
+
+
+  for (buf = &static_buf[FP_SLOT]; buf < &static_buf[_CACHE_SLOTS]; buf++) {
+    if (buf->owner == fp) buf->owner = NULL;
+  }
+#else
+  if (fp->fs->buf.owner == fp) fp->fs->buf.owner = NULL;
+#endif
+}
+#else
+#define release_fp_window(fp)
+#endif
+
+
+
+
+#if !_FS_READONLY
+static
+BOOL take_fp_window(    /* Claim the window for a sector past EOF, without reading it */
+  FIL* fp,
+  DWORD  sector
+)
+{
+#if _CACHE_SLOTS > 1
+  fp_buf = pick_fp_window(fp->fs,sector);
+#endif
+  if (FPBUF.sect != sector
+#if _USE_1_BUF != 0
+      || FPBUF.fs != fp->fs
+#endif
+     ) {
+    if (!move_window(fp->fs,&FPBUF,0)) return FALSE;
+    FPBUF.sect = sector;
+#if _USE_1_BUF != 0
+    FPBUF.fs = fp->fs;
+#endif
+  }
+  return TRUE;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Clean-up cached data                                                  */
 /*-----------------------------------------------------------------------*/
@@ -196,7 +321,7 @@ FRESULT sync (          /* FR_OK: successful, FR_RW_ERROR: failed */
   }
 #endif
   /* Make sure that no pending write process in the physical drive */
-  if (disk_ioctl(fs->drive, CTRL_SYNC, NULL) != RES_OK)
+  if (disk_sync(fs->drive) != RES_OK)
     return FR_RW_ERROR;
   return FR_OK;
 }
@@ -298,6 +423,96 @@ BOOL put_cluster (      /* TRUE: successful, FALSE: failed */
 
 
 
+#if !_FS_READONLY && _USE_FREE_RUNS
+/*-----------------------------------------------------------------------*/
+/* Keep Track of Free Cluster Runs                                       */
+/*-----------------------------------------------------------------------*/
+
+static
+BOOL add_free (         /* TRUE: the cluster is in a run now, FALSE: no room */
+  FATFS *fs,            /* File system object */
+  DWORD clust           /* Free cluster# */
+)
+{
+  FFREE *run, *empty = NULL;
+
+
+  for (run = fs->free_run; run < &fs->free_run[_USE_FREE_RUNS]; run++) {
+    if (!run->len) {
+      if (!empty) empty = run;
+    } else if (clust - run->clust < run->len) {     /* Already known */
+      return TRUE;
+    } else if (run->len != 0xFFFF) {
+      if (clust == run->clust + run->len) {         /* Grow the run at its end */
+        run->len++;
+        return TRUE;
+      }
+      if (clust + 1 == run->clust) {                /* Grow the run at its start */
+        run->clust--;
+        run->len++;
+        return TRUE;
+      }
+    }
+  }
+  if (!empty) return FALSE;
+  empty->clust = clust;
+  empty->len = 1;
+  return TRUE;
+}
+
+
+
+
+static
+void drop_free (
+  FATFS *fs,            /* File system object */
+  DWORD clust           /* Cluster# no longer free */
+)
+{
+  FFREE *run;
+
+
+  for (run = fs->free_run; run < &fs->free_run[_USE_FREE_RUNS]; run++) {
+    if (clust - run->clust < run->len) {
+      if (clust == run->clust) {                    /* Shrink from the start */
+        run->clust++;
+        run->len--;
+      } else {                                      /* Drop the rest of the run */
+        if (clust + 1 < run->clust + run->len && clust + 1 < fs->scan_clust)
+          fs->scan_clust = clust + 1;               /* f_scanfree() finds the rest again */
+        run->len = (WORD)(clust - run->clust);
+      }
+    }
+  }
+}
+
+
+
+
+static
+DWORD take_free (       /* 0: none known, >=2: cluster# taken out of the runs */
+  FATFS *fs             /* File system object */
+)
+{
+  FFREE *run;
+
+
+  for (run = fs->free_run; run < &fs->free_run[_USE_FREE_RUNS]; run++) {
+    if (run->len) {
+      run->len--;
+      return run->clust++;
+    }
+  }
+  return 0;
+}
+#else
+#define add_free(fs, clust)
+#define drop_free(fs, clust)
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Remove a cluster chain                                                */
 /*-----------------------------------------------------------------------*/
@@ -316,6 +531,10 @@ BOOL remove_chain (     /* TRUE: successful, FALSE: failed */
     nxt = get_cluster(fs, clust);
     if (nxt == 1) return FALSE;
     if (!put_cluster(fs, clust, 0)) return FALSE;
+#if _USE_FREE_RUNS
+    if (!add_free(fs, clust) && clust < fs->scan_clust)
+      fs->scan_clust = clust;               /* No room, let f_scanfree() come back for it */
+#endif
     if (fs->free_clust != 0xFFFFFFFF) {
       fs->free_clust++;
 #if _USE_FSINFO
@@ -356,18 +575,35 @@ DWORD create_chain (    /* 0: No free cluster, 1: Error, >=2: New cluster number
     scl = clust;
   }
 
-  ncl = scl;                              /* Start cluster */
-  for (;;) {
-    ncl++;                                /* Next cluster */
-    if (ncl >= mcl) {                     /* Wrap around */
-      ncl = 2;
-      if (ncl > scl) return 0;            /* No free custer */
+#if _USE_FREE_RUNS
+  ncl = 0;
+  if (clust && clust + 1 < mcl) {         /* Keep the chain contiguous if the next cluster is free */
+    cstat = get_cluster(fs, clust + 1);
+    if (cstat == 1) return 1;
+    if (cstat == 0) ncl = clust + 1;
+  }
+  while (!ncl && (ncl = take_free(fs)) != 0) {  /* Else use one known to be free */
+    cstat = get_cluster(fs, ncl);
+    if (cstat == 1) return 1;
+    if (cstat != 0) ncl = 0;              /* Stale, try the next one */
+  }
+  if (!ncl)
+#endif
+  {
+    ncl = scl;                            /* Start cluster */
+    for (;;) {
+      ncl++;                              /* Next cluster */
+      if (ncl >= mcl) {                   /* Wrap around */
+        ncl = 2;
+        if (ncl > scl) return 0;          /* No free custer */
+      }
+      cstat = get_cluster(fs, ncl);       /* Get the cluster status */
+      if (cstat == 0) break;              /* Found a free cluster */
+      if (cstat == 1) return 1;           /* Any error occured */
+      if (ncl == scl) return 0;           /* No free custer */
     }
-    cstat = get_cluster(fs, ncl);         /* Get the cluster status */
-    if (cstat == 0) break;                /* Found a free cluster */
-    if (cstat == 1) return 1;             /* Any error occured */
-    if (ncl == scl) return 0;             /* No free custer */
   }
+  drop_free(fs, ncl);                     /* It may sit in a known run */
 
   if (!put_cluster(fs, ncl, 0x0FFFFFFF)) return 1;      /* Mark the new cluster "in use" */
   if (clust && !put_cluster(fs, clust, ncl)) return 1;  /* Link it to previous one if needed */
@@ -570,6 +806,61 @@ UCHAR make_dirfile (     /* 1: error - detected an invalid format, '\0'or'/': ne
 
 
 
+#if _USE_PATH_CACHE
+/*-----------------------------------------------------------------------*/
+/* Remember Traced Paths                                                 */
+/*-----------------------------------------------------------------------*/
+
+typedef struct _PATHC {
+  DWORD base;           /* First sector of the directory the trace started in, 0: unused */
+  DWORD hash;           /* Hash of the name, only single 8.3 names are kept */
+  DWORD sclust;         /* Directory object at the entry found */
+  DWORD clust;
+  DWORD sect;
+  WORD  index;
+#if _USE_LFN != 0
+  DWORD lclust;         /* Start of the LFN entries */
+  DWORD lsect;
+  WORD  lindex;
+  BYTE  len;            /* Length of the LFN, 0: none */
+#endif
+} PATHC;
+
+static
+PATHC path_cache[_USE_PATH_CACHE];
+static
+BYTE path_next;         /* Slot to fill next */
+
+
+static
+DWORD path_hash (       /* Case blind hash of a path string */
+  const UCHAR *path
+)
+{
+  DWORD hash = 5381;
+  UCHAR c;
+
+
+  while ((c = *path++) != 0) {
+    if (c >= 'a' && c <= 'z') c -= 0x20;
+    hash = (hash << 5) + hash + c;
+  }
+  return hash;
+}
+
+
+static
+void path_cache_clear (void)
+{
+  memset(path_cache, 0, sizeof(path_cache));
+}
+#else
+#define path_cache_clear()
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Trace a file path                                                     */
 /*-----------------------------------------------------------------------*/
@@ -598,6 +889,11 @@ FRESULT trace_path (     /* FR_OK(0): successful, !=0: error code */
   UINT l;
   BOOL store=TRUE;
 #endif
+#if _USE_PATH_CACHE
+  PATHC *pc;
+  DWORD base, hash;
+  const UCHAR *top;
+#endif
 
   /* Initialize directory object */
 #if _USE_CHDIR != 0 || _USE_CURR_DIR != 0
@@ -633,6 +929,42 @@ FRESULT trace_path (     /* FR_OK(0): successful, !=0: error code */
     *dir = NULL; return FR_OK;
   }
 
+#if _USE_PATH_CACHE
+  /* Go straight to the entry if this name was traced before.  Only */
+  /* single 8.3 names are kept, so a hit is checked against the entry */
+  base = dj->sect;
+  hash = 0;                     /* Not kept */
+  top = path;
+  if (make_dirfile(&top, fn, &lfn) == 0 && !lfn) {
+    hash = path_hash(path);
+    for (pc = path_cache; pc < &path_cache[_USE_PATH_CACHE]; pc++) {
+      if (pc->base != base || pc->hash != hash) continue;
+      if (!move_fs_window(fs, pc->sect)) return FR_RW_ERROR;
+      dptr = &FSBUF.data[(pc->index & ((SS(fs) - 1) / 32)) * 32];
+      if (dptr[DIR_Name] == 0 || dptr[DIR_Name] == 0xE5   /* Entry is gone, trace it again */
+          || (dptr[DIR_Attr] & AM_LFN) == AM_LFN) {
+        pc->base = 0;
+        break;
+      }
+      if (memcmp(&dptr[DIR_Name], fn, 8+3)) continue;    /* Another name with the same hash */
+      dj->sclust = pc->sclust;
+      dj->clust = pc->clust;
+      dj->sect = pc->sect;
+      dj->index = pc->index;
+      fn[11] = dptr[DIR_NTres];
+#if _USE_LFN != 0
+      fileobj->clust = pc->lclust;
+      fileobj->sect = pc->lsect;
+      fileobj->index = pc->lindex;
+      *len = pc->len;
+      *spath = path;
+#endif
+      *dir = dptr;
+      return FR_OK;
+    }
+  }
+#endif
+
   for (;;) {
 #if _USE_LFN != 0
     *spath=path;     // save this off, as we may need it for the LFN
@@ -729,7 +1061,27 @@ FRESULT trace_path (     /* FR_OK(0): successful, !=0: error code */
         return !ds ? FR_NO_FILE : FR_NO_PATH;
       }
     }
-    if (!ds) { *dir = dptr; return FR_OK; }             /* Matched with end of path */
+    if (!ds) {                                          /* Matched with end of path */
+#if _USE_PATH_CACHE
+      if (hash) {
+        pc = &path_cache[path_next];
+        path_next = (path_next + 1) % _USE_PATH_CACHE;
+        pc->base = base;
+        pc->hash = hash;
+        pc->sclust = dj->sclust;
+        pc->clust = dj->clust;
+        pc->sect = dj->sect;
+        pc->index = dj->index;
+#if _USE_LFN != 0
+        pc->lclust = fileobj->clust;
+        pc->lsect = fileobj->sect;
+        pc->lindex = fileobj->index;
+        pc->len = (BYTE)*len;
+#endif
+      }
+#endif
+      *dir = dptr; return FR_OK;
+    }
     if (!(dptr[DIR_Attr] & AM_DIR)) return FR_NO_PATH;  /* Cannot trace because it is a file */
     clust = ((DWORD)LD_WORD(&dptr[DIR_FstClusHI]) << 16)
       | LD_WORD(&dptr[DIR_FstClusLO]);                  /* Get cluster# of the directory */
@@ -886,8 +1238,18 @@ FRESULT mount_drv(
   DSTATUS stat;
   BYTE fmt, *tbl;
   DWORD bootsect, fatsize, totalsect, maxclust;
+#if _CACHE_SLOTS > 1
+  BUF *buf;
+#endif
 
   memset(fs, 0, sizeof(FATFS));       /* Clean-up the file system object */
+  path_cache_clear();                 /* Paths may be on another card now */
+#if _CACHE_SLOTS > 1
+  for (buf = &static_buf[FP_SLOT]; buf < &static_buf[_CACHE_SLOTS]; buf++) {
+    buf->sect = 0;                    /* File data may be from another card */
+    buf->dirty = FALSE;
+  }
+#endif
   fs->drive = LD2PD(drv);             /* Bind the logical drive and a physical drive */
   stat = disk_initialize(fs->drive);  /* Initialize low level disk I/O layer */
   if (stat & STA_NOINIT)              /* Check if the drive is ready */
@@ -1511,6 +1873,9 @@ FRESULT f_open (
   fp->fsize = LD_DWORD(&dir[DIR_FileSize]);         /* File size */
   fp->fptr = 0;                                     /* Initialize file pointer */
   fp->csect = 1;                                    /* Sector counter */
+#if _USE_FASTSEEK
+  fp->n_run = 0;                                    /* No cluster runs known yet */
+#endif
   fp->fs = fs; //fp->id = fs->id;       /* Owner file system object of the file */
 
 #if !_FS_READONLY
@@ -1612,6 +1977,188 @@ fr_error: /* Abort this file due to an unrecoverable error */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Read File Data In Place                                               */
+/*-----------------------------------------------------------------------*/
+/* Loads the sector holding the file pointer into the file window and   */
+/* returns a pointer to the data there, up to btr bytes but never past  */
+/* the end of that sector.  The file pointer is advanced past the data. */
+/* The pointer is only valid until the next call into FatFs.            */
+
+FRESULT f_read_window (
+  FIL *fp,            /* Pointer to the file object */
+  const BYTE **buff,  /* Pointer to receive the data pointer */
+  UINT btr,           /* Maximum number of bytes wanted */
+  UINT *br            /* Pointer to number of bytes available */
+)
+{
+  FRESULT res;
+  DWORD clust, sect, remain;
+  UINT rcnt;
+  FATFS *fs = fp->fs;
+
+
+  *br = 0;
+  res = validate(fs /*, fp->id*/);                   /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR; /* Check error flag */
+  if (!(fp->flag & FA_READ)) return FR_DENIED;  /* Check access mode */
+  remain = fp->fsize - fp->fptr;
+  if (btr > remain) btr = (UINT)remain;         /* Truncate read count by number of bytes left */
+  if (!btr) return FR_OK;
+
+  if ((fp->fptr & (SS(fs) - 1)) == 0) {         /* On the sector boundary */
+    if (--fp->csect) {                          /* Decrement left sector counter */
+      sect = fp->curr_sect + 1;                 /* Get current sector */
+    } else {                                    /* On the cluster boundary, get next cluster */
+      clust = (fp->fptr == 0) ?
+        fp->org_clust : get_cluster(fs, fp->curr_clust);
+      if (clust < 2 || clust >= fs->max_clust)
+        goto fr_error;
+      fp->curr_clust = clust;                   /* Current cluster */
+      sect = clust2sect(fs, clust);             /* Get current sector */
+      fp->csect = fs->csize;                    /* Re-initialize the left sector counter */
+    }
+#if !_FS_READONLY
+    if(!move_fp_window(fp,0)) goto fr_error;
+#endif
+    fp->curr_sect = sect;                       /* Update current sector */
+  }
+  rcnt = SS(fs) - ((WORD)fp->fptr & (SS(fs) - 1));  /* Bytes left in this sector */
+  if (rcnt > btr) rcnt = btr;
+  if(!move_fp_window(fp,fp->curr_sect)) goto fr_error;
+  *buff = &FPBUF.data[fp->fptr & (SS(fs) - 1)];
+  fp->fptr += rcnt;
+  *br = rcnt;
+
+  return FR_OK;
+
+fr_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Hand Back Unused Window Data                                          */
+/*-----------------------------------------------------------------------*/
+/* Moves the file pointer back over the last cnt bytes returned by      */
+/* f_read_window().  Within the sector that is just a pointer update,   */
+/* only a return to the very start of it needs the sector fields redone. */
+
+FRESULT f_unread_window (
+  FIL *fp,      /* Pointer to the file object */
+  UINT cnt      /* Number of bytes to hand back */
+)
+{
+  DWORD ofs = fp->fptr - cnt;
+
+  if (cnt && !(ofs & (SS(fp->fs) - 1)))         /* Back on a sector boundary */
+    return f_lseek(fp, ofs);
+  fp->fptr = ofs;
+  return FR_OK;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Read Ahead                                                            */
+/*-----------------------------------------------------------------------*/
+/* Loads the sector the next read will start in into the window, when   */
+/* it can be found without going through the FAT.  Meant for idle time, */
+/* so the next read finds its data already in place.                    */
+
+FRESULT f_prefetch (
+  FIL *fp       /* Pointer to the file object */
+)
+{
+  DWORD sect;
+  FATFS *fs = fp->fs;
+  FRESULT res;
+
+
+  res = validate(fs /*, fp->id*/);                   /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR; /* Check error flag */
+  if (fp->fptr >= fp->fsize) return FR_OK;      /* Nothing left to read */
+  if (fp->fptr & (SS(fs) - 1))                  /* Inside a sector */
+    sect = fp->curr_sect;
+  else if (fp->fptr == 0)                       /* Top of the file */
+    sect = clust2sect(fs, fp->org_clust);
+  else if (fp->csect > 1)                       /* Next sector of this cluster */
+    sect = fp->curr_sect + 1;
+  else                                          /* Next cluster needs the FAT */
+    return FR_OK;
+  if (sect && !move_fp_window(fp,sect)) return FR_RW_ERROR;
+  return FR_OK;
+}
+
+
+
+
+#if _USE_STREAM
+/*-----------------------------------------------------------------------*/
+/* Stream File Sectors Out                                               */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_read_stream (
+  FIL *fp,      /* Pointer to the file object */
+  UINT btr,     /* Number of bytes to stream, only whole sectors are moved */
+  UINT *br,     /* Pointer to number of bytes streamed */
+  DRESULT (*func)(BYTE, DWORD)  /* Function moving one sector out of the drive */
+)
+{
+  FRESULT res;
+  DWORD clust, sect, remain;
+  FATFS *fs = fp->fs;
+
+
+  *br = 0;
+  res = validate(fs /*, fp->id*/);                   /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR; /* Check error flag */
+  if (!(fp->flag & FA_READ)) return FR_DENIED;  /* Check access mode */
+  if (fp->fptr & (SS(fs) - 1)) return FR_OK;    /* Only from a sector boundary */
+  remain = fp->fsize - fp->fptr;
+  if (btr > remain) btr = (UINT)remain;         /* Truncate read count by number of bytes left */
+
+  for ( ;  btr >= SS(fs);                       /* Repeat while whole sectors are left */
+    fp->fptr += SS(fs), *br += SS(fs), btr -= SS(fs)) {
+    if (--fp->csect) {                          /* Decrement left sector counter */
+      sect = fp->curr_sect + 1;                 /* Get current sector */
+    } else {                                    /* On the cluster boundary, get next cluster */
+      clust = (fp->fptr == 0) ?
+        fp->org_clust : get_cluster(fs, fp->curr_clust);
+      if (clust < 2 || clust >= fs->max_clust)
+        goto fr_error;
+      fp->curr_clust = clust;                   /* Current cluster */
+      sect = clust2sect(fs, clust);             /* Get current sector */
+      fp->csect = fs->csize;                    /* Re-initialize the left sector counter */
+    }
+#if !_FS_READONLY
+    if(!move_fp_window(fp,0)) goto fr_error;    /* Write back the window before handing off the drive */
+#endif
+    fp->curr_sect = sect;                       /* Update current sector */
+    if (func(fs->drive, sect) != RES_OK) {      /* The sector is gone either way, but the file is intact */
+      fp->fptr += SS(fs); *br += SS(fs);
+      return FR_RW_ERROR;
+    }
+  }
+
+  return FR_OK;
+
+fr_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+#endif
+
+
+
+
 #if !_FS_READONLY
 /*-----------------------------------------------------------------------*/
 /* Write File                                                            */
@@ -1662,6 +2209,7 @@ FRESULT f_write (
       cc = btw / SS(fs);                          /* When left bytes >= SS(fs), */
       if (cc) {                                   /* Write maximum contiguous sectors directly */
         if (cc > fp->csect) cc = fp->csect;
+        drop_fp_window(fs, sect, cc);
         if (disk_write(fs->drive, wbuff, sect, (BYTE)cc) != RES_OK)
           goto fw_error;
         fp->csect -= (BYTE)(cc - 1);
@@ -1673,15 +2221,104 @@ FRESULT f_write (
     if(btw) {
       wcnt = SS(fs) - ((WORD)fp->fptr & (SS(fs) - 1));  /* Copy fractional bytes to file I/O buffer */
       if (wcnt > btw) wcnt = btw;
-      if (
-#if _USE_1_BUF == 0
-      fp->fptr < fp->fsize &&       /* Fill sector buffer with file data if needed */
-#endif
-      !move_fp_window(fp,fp->curr_sect))
-    goto fw_error;
+      if ((fp->fptr & ~(DWORD)(SS(fs) - 1)) >= fp->fsize) { /* Appending a fresh sector, nothing to read */
+        if (!take_fp_window(fp,fp->curr_sect)) goto fw_error;
+      } else if (!move_fp_window(fp,fp->curr_sect))         /* Fill sector buffer with file data */
+        goto fw_error;
       memcpy(&FPBUF.data[fp->fptr & (SS(fs) - 1)], wbuff, wcnt);
       FPBUF.dirty=TRUE;
+#if _USE_FS_BUF != 0
+      FPBUF.owner = fp;
+#endif
+    }
+  }
+
+  if (fp->fptr > fp->fsize) fp->fsize = fp->fptr; /* Update file size if needed */
+  fp->flag |= FA__WRITTEN;                        /* Set file changed flag */
+  return FR_OK;
+
+fw_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Write Zeros to File                                                   */
+/*-----------------------------------------------------------------------*/
+/* Extends or pads a file with btw zero bytes.  Whole sectors are       */
+/* written straight from a zeroed window, so no data buffer is needed   */
+/* and the cluster chain is stretched once per cluster.                 */
+
+FRESULT f_write_zero (
+  FIL *fp,      /* Pointer to the file object */
+  DWORD btw,    /* Number of zero bytes to write */
+  DWORD *bw     /* Pointer to number of bytes written */
+)
+{
+  FRESULT res;
+  DWORD clust, sect;
+  UINT wcnt;
+  BOOL zeroed = FALSE;                            /* Window holds a sector of zeros */
+  FATFS *fs = fp->fs;
+
+
+  *bw = 0;
+  res = validate(fs /*, fp->id*/);                     /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;   /* Check error flag */
+  if (!(fp->flag & FA_WRITE)) return FR_DENIED;   /* Check access mode */
+  if (fp->fsize + btw < fp->fsize) return FR_OK;  /* File size cannot reach 4GB */
+
+  for ( ;  btw;                                   /* Repeat until all zeros are written */
+    fp->fptr += wcnt, *bw += wcnt, btw -= wcnt) {
+    if ((fp->fptr & (SS(fs) - 1)) == 0) {         /* On the sector boundary */
+      if (--fp->csect) {                          /* Decrement left sector counter */
+        sect = fp->curr_sect + 1;                 /* Get current sector */
+      } else {                                    /* On the cluster boundary, get next cluster */
+        if (fp->fptr == 0) {                      /* Is top of the file */
+          clust = fp->org_clust;
+          if (clust == 0)                         /* No cluster is created yet */
+            fp->org_clust = clust = create_chain(fs, 0);    /* Create a new cluster chain */
+        } else {                                  /* Middle or end of file */
+          clust = create_chain(fs, fp->curr_clust);         /* Trace or streach cluster chain */
+        }
+        zeroed = FALSE;                           /* The FAT may have passed through the window */
+        if (clust == 0) break;                    /* Disk full */
+        if (clust == 1 || clust >= fs->max_clust) goto fw_error;
+        fp->curr_clust = clust;                   /* Current cluster */
+        sect = clust2sect(fs, clust);             /* Get current sector */
+        fp->csect = fs->csize;                    /* Re-initialize the left sector counter */
+      }
+      if(!move_fp_window(fp,0)) goto fw_error;
+      fp->curr_sect = sect;                       /* Update current sector */
+      if (btw >= SS(fs)) {                        /* Whole sector, write it from the zeroed window */
+        if (!zeroed) {
+          FPBUF.sect = 0;                         /* Window no longer holds any sector */
+          memset(FPBUF.data, 0, SS(fs));
+          zeroed = TRUE;
+        }
+        drop_fp_window(fs, sect, 1);
+        if (disk_write(fs->drive, FPBUF.data, sect, 1) != RES_OK)
+          goto fw_error;
+        wcnt = SS(fs);
+        continue;
+      }
     }
+    wcnt = SS(fs) - ((WORD)fp->fptr & (SS(fs) - 1));  /* Zero fractional bytes in file I/O buffer */
+    if (wcnt > btw) wcnt = (UINT)btw;
+    if ((fp->fptr & ~(DWORD)(SS(fs) - 1)) >= fp->fsize) {   /* Appending a fresh sector, nothing to read */
+      if (!take_fp_window(fp,fp->curr_sect)) goto fw_error;
+    } else if (!move_fp_window(fp,fp->curr_sect))           /* Fill sector buffer with file data */
+      goto fw_error;
+    zeroed = FALSE;
+    memset(&FPBUF.data[fp->fptr & (SS(fs) - 1)], 0, wcnt);
+    FPBUF.dirty=TRUE;
+#if _USE_FS_BUF != 0
+    FPBUF.owner = fp;
+#endif
   }
 
   if (fp->fptr > fp->fsize) fp->fsize = fp->fptr; /* Update file size if needed */
@@ -1696,6 +2333,106 @@ fw_error: /* Abort this file due to an unrecoverable error */
 
 
 
+#if _USE_FREE_RUNS
+/*-----------------------------------------------------------------------*/
+/* Look for Free Clusters                                                */
+/*-----------------------------------------------------------------------*/
+/* Walks the FAT a little further each call and notes the free clusters */
+/* it passes, until the runs are full or the end of the FAT is reached.  */
+/* Returns the number of clusters looked at, 0 when there is nothing to  */
+/* do.  Meant for idle time.                                             */
+
+UINT f_scanfree (
+  FATFS *fs     /* Pointer to the file system object */
+)
+{
+  DWORD clust, cstat;
+  UINT n = 0;
+
+
+  if (validate(fs) != FR_OK) return 0;
+  clust = fs->scan_clust;
+  if (clust < 2) clust = 2;
+  for ( ; n < 256 && clust < fs->max_clust; n++, clust++) {
+    cstat = get_cluster(fs, clust);
+    if (cstat == 1) {                       /* Give up on errors */
+      clust = fs->max_clust;
+      break;
+    }
+    if (cstat == 0 && !add_free(fs, clust)) /* Runs are full, carry on later */
+      break;
+  }
+  fs->scan_clust = clust;
+  return n;
+}
+#endif
+
+
+
+
+#if _USE_STREAM
+/*-----------------------------------------------------------------------*/
+/* Stream File Sectors In                                                */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_write_stream (
+  FIL *fp,      /* Pointer to the file object */
+  UINT btw,     /* Number of bytes to stream, only whole sectors are moved */
+  UINT *bw,     /* Pointer to number of bytes streamed */
+  DRESULT (*func)(BYTE, DWORD)  /* Function moving one sector into the drive */
+)
+{
+  FRESULT res;
+  DWORD clust, sect;
+  FATFS *fs = fp->fs;
+
+
+  *bw = 0;
+  res = validate(fs /*, fp->id*/);                     /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;   /* Check error flag */
+  if (!(fp->flag & FA_WRITE)) return FR_DENIED;   /* Check access mode */
+  if (fp->fsize + btw < fp->fsize) return FR_OK;  /* File size cannot reach 4GB */
+  if (fp->fptr & (SS(fs) - 1)) return FR_OK;      /* Only from a sector boundary */
+
+  for ( ;  btw >= SS(fs);                         /* Repeat while whole sectors are left */
+    fp->fptr += SS(fs), *bw += SS(fs), btw -= SS(fs)) {
+    if (--fp->csect) {                            /* Decrement left sector counter */
+      sect = fp->curr_sect + 1;                   /* Get current sector */
+    } else {                                      /* On the cluster boundary, get next cluster */
+      if (fp->fptr == 0) {                        /* Is top of the file */
+        clust = fp->org_clust;
+        if (clust == 0)                           /* No cluster is created yet */
+          fp->org_clust = clust = create_chain(fs, 0);    /* Create a new cluster chain */
+      } else {                                    /* Middle or end of file */
+        clust = create_chain(fs, fp->curr_clust);         /* Trace or streach cluster chain */
+      }
+      if (clust == 0) break;                      /* Disk full */
+      if (clust == 1 || clust >= fs->max_clust) goto fw_error;
+      fp->curr_clust = clust;                     /* Current cluster */
+      sect = clust2sect(fs, clust);               /* Get current sector */
+      fp->csect = fs->csize;                      /* Re-initialize the left sector counter */
+    }
+    if(!move_fp_window(fp,0)) goto fw_error;      /* Write back the window before handing off the drive */
+    drop_fp_window(fs, sect, 1);                  /* Window contents are about to be stale */
+    fp->curr_sect = sect;                         /* Update current sector */
+    if (func(fs->drive, sect) != RES_OK)
+      goto fw_error;
+  }
+
+  if (fp->fptr > fp->fsize) fp->fsize = fp->fptr; /* Update file size if needed */
+  fp->flag |= FA__WRITTEN;                        /* Set file changed flag */
+  return FR_OK;
+
+fw_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+#endif
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Synchronize the file object                                           */
 /*-----------------------------------------------------------------------*/
@@ -1728,6 +2465,8 @@ FRESULT f_sync (
       fp->flag &= (BYTE)~FA__WRITTEN;
       res = sync(fs);
     }
+    if (res == FR_OK && (fp->flag & FA__ERROR))  /* A deferred write-back failed */
+      res = FR_RW_ERROR;
   }
   return res;
 }
@@ -1750,6 +2489,7 @@ FRESULT f_close (
 
 #if !_FS_READONLY
   res = f_sync(fp);
+  release_fp_window(fp);    /* The FIL may be reused even if the sync failed */
 #else
   res = validate(fp->fs /*, fp->id*/);
 #endif
@@ -1760,6 +2500,62 @@ FRESULT f_close (
 
 
 
+#if _USE_FASTSEEK
+/*-----------------------------------------------------------------------*/
+/* Find a Cluster Through the Run Table                                  */
+/*-----------------------------------------------------------------------*/
+/* Returns the cluster at index *idx of the file.  The FAT is only read */
+/* past the runs already known, and what is found there is added.  If  */
+/* the table fills up or the chain ends first, *idx is lowered to the  */
+/* last index that could be resolved.  Returns 0 for an empty file.    */
+
+static
+DWORD run_cluster (
+  FIL *fp,      /* Pointer to the file object */
+  DWORD *idx    /* Cluster index in the file, the index found on return */
+)
+{
+  FRUN *run = fp->run;
+  BYTE n = fp->n_run, lo, hi, mid;
+  DWORD clust, next;
+
+
+  if (!n) {                                     /* Start with the first cluster */
+    if (!fp->org_clust) return 0;
+    run[0].clust = fp->org_clust;
+    run[0].end = 1;
+    n = 1;
+  }
+  while (*idx >= run[n - 1].end && run[n - 1].end != 0xFFFF) {
+    clust = run[n - 1].clust + run[n - 1].end - (n > 1 ? run[n - 2].end : 0) - 1;  /* Last cluster known */
+    next = get_cluster(fp->fs, clust);
+    if (next < 2 || next >= fp->fs->max_clust)  /* End of chain or error, the caller walks on */
+      break;
+    if (next == clust + 1) {                    /* Still contiguous */
+      run[n - 1].end++;
+    } else if (n < _USE_FASTSEEK) {             /* Start a new run */
+      run[n].clust = next;
+      run[n].end = run[n - 1].end + 1;
+      n++;
+    } else {                                    /* Table is full */
+      break;
+    }
+  }
+  fp->n_run = n;
+  if (*idx >= run[n - 1].end) *idx = run[n - 1].end - 1;
+  lo = 0; hi = n - 1;
+  while (lo < hi) {                             /* Find the first run ending past idx */
+    mid = (lo + hi) / 2;
+    if (run[mid].end > *idx) hi = mid;
+    else lo = mid + 1;
+  }
+  return run[lo].clust + *idx - (lo ? run[lo - 1].end : 0);
+}
+#endif
+
+
+
+
 #if _FS_MINIMIZE <= 2
 /*-----------------------------------------------------------------------*/
 /* Seek File R/W Pointer                                                 */
@@ -1772,6 +2568,9 @@ FRESULT f_lseek (
 {
   FRESULT res;
   DWORD clust, csize;
+#if _USE_FASTSEEK
+  DWORD idx, cl;
+#endif
   CHAR csect;
   FATFS *fs = fp->fs;
 
@@ -1791,10 +2590,10 @@ FRESULT f_lseek (
   /* Move file R/W pointer if needed */
   if (ofs) {
     csize = (DWORD)fs->csize * SS(fs);        /* Cluster size in unit of byte */
-    if(ofs/csize == (fp->fptr-1)/csize) {
+    if((ofs-1)/csize == (fp->fptr-1)/csize) {
       /* Source and Target are in the same cluster.  Just reset sector fields */
       fp->fptr = ofs;
-      ofs-=(((DWORD)(ofs/csize))*csize); /* subtract off up to current cluster */
+      ofs-=(((DWORD)((ofs-1)/csize))*csize); /* subtract off up to current cluster */
     } else {
       fp->csect = 1;
 
@@ -1813,6 +2612,17 @@ FRESULT f_lseek (
         if (clust == 1) goto fk_error;
         fp->org_clust = clust;
       }
+#endif
+#if _USE_FASTSEEK
+      if (clust) {                /* Jump as far as the known runs reach */
+        idx = (fp->fptr + ofs - 1) / csize;
+        cl = run_cluster(fp, &idx);
+        if (cl && idx * csize > fp->fptr) {
+          ofs += fp->fptr - idx * csize;
+          fp->fptr = idx * csize;
+          clust = cl;
+        }
+      }
 #endif
       if (clust) {                /* If the file has a cluster chain, it can be followed */
         for (;;) {                                  /* Loop to skip leading clusters */
@@ -1857,6 +2667,57 @@ fk_error: /* Abort this file due to an unrecoverable error */
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Seek File R/W Pointer Within a Known Cluster                          */
+/*-----------------------------------------------------------------------*/
+/* Like f_lseek(), for callers that already know which cluster holds    */
+/* the byte just before ofs (the cluster f_lseek() leaves in curr_clust */
+/* for that offset).  No cluster chain is followed.                     */
+
+FRESULT f_lseek_clust (
+  FIL *fp,      /* Pointer to the file object */
+  DWORD ofs,    /* File pointer from top of file, must not be 0 */
+  DWORD clust   /* Cluster holding byte ofs - 1 */
+)
+{
+  FRESULT res;
+  BYTE csect;
+  FATFS *fs = fp->fs;
+
+  res = validate(fs /*, fp->id*/);          /* Check validity of the object */
+  if (res != FR_OK) return res;
+  if (fp->flag & FA__ERROR) return FR_RW_ERROR;
+  if (clust < 2 || clust >= fs->max_clust) return FR_RW_ERROR;
+  if (ofs > fp->fsize                       /* In read-only mode, let f_lseek() clip the offset */
+#if !_FS_READONLY
+       && !(fp->flag & FA_WRITE)
+#endif
+      ) return f_lseek(fp, ofs);
+  if (fp->fptr == ofs)                      /* Don't seek if the target is the current position */
+    return FR_OK;
+  if (!move_fp_window(fp,0)) goto fk_error;
+  fp->fptr = ofs;
+  fp->curr_clust = clust;
+  csect = (BYTE)(((ofs - 1) / SS(fs)) & (fs->csize - 1));  /* Sector offset in the cluster */
+  fp->curr_sect = clust2sect(fs, clust) + csect;          /* Current sector */
+  fp->csect = fs->csize - csect;                          /* Left sector counter in the cluster */
+#if !_FS_READONLY
+  if (fp->fptr > fp->fsize) {             /* Set changed flag if the file was extended */
+    fp->fsize = fp->fptr;
+    fp->flag |= FA__WRITTEN;
+  }
+#endif
+
+  return FR_OK;
+
+fk_error: /* Abort this file due to an unrecoverable error */
+  fp->flag |= FA__ERROR;
+  return FR_RW_ERROR;
+}
+
+
+
+
 #if _FS_MINIMIZE <= 1
 /*-----------------------------------------------------------------------*/
 /* Create a directroy object                                             */
@@ -1895,7 +2756,7 @@ FRESULT f_opendir (
     if (res == FR_OK) {                        /* Trace completed */
       if (dir != NULL) {                       /* It is not the root dir */
         if (dir[DIR_Attr] & AM_DIR) {          /* The entry is a directory */
-          dj->clust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
+          dj->clust = dj->sclust = ((DWORD)LD_WORD(&dir[DIR_FstClusHI]) << 16) | LD_WORD(&dir[DIR_FstClusLO]);
           dj->sect = clust2sect(fs, dj->clust);
 #if _USE_CHDIR != 0  || _USE_CURR_DIR != 0
           dj->index = 0;
@@ -2054,6 +2915,50 @@ FRESULT f_readdir (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Get Directory Signature                                               */
+/*-----------------------------------------------------------------------*/
+/* Checksums the directory sectors up to the end mark, so any change to  */
+/* the entries, sizes and dates included, changes the signature.  The    */
+/* directory object is not moved.  The signature is never 0.             */
+
+FRESULT f_dirsig (
+  const DIR *dj,     /* Pointer to the directory object, at its start */
+  DWORD *sig         /* Pointer to the signature to return */
+)
+{
+  DIR d = *dj;
+  FATFS *fs = d.fs;
+  BYTE *p, res;
+  DWORD sum = 0;
+  UINT i;
+  BOOL end = FALSE;
+
+
+  res = validate(fs /*, dj->id*/);         /* Check validity of the object */
+  if (res != FR_OK) return (FRESULT)res;
+
+  while (!end) {
+    if (!move_fs_window(fs, d.sect))
+      return FR_RW_ERROR;
+    p = FSBUF.data;
+    for (i = 0; i < SS(fs); i++) {
+      if (!(i & 31) && !p[i]) {          /* End of dir */
+        end = TRUE;
+        break;
+      }
+      sum = ((sum << 1) | (sum >> 31)) + p[i];
+    }
+    d.index |= (SS(fs) - 1) / 32;        /* Last entry in this sector */
+    if (!end && !next_dir_entry(&d)) end = TRUE;
+  }
+  *sig = (sum ? sum : 1);
+  return FR_OK;
+}
+
+
+
+
 #if _FS_MINIMIZE == 0
 /*-----------------------------------------------------------------------*/
 /* Get File Status                                                       */
@@ -2125,6 +3030,9 @@ FRESULT f_truncate (
   if (fp->fsize > fp->fptr) {
     fp->fsize = fp->fptr; /* Set file size to current R/W point */
     fp->flag |= FA__WRITTEN;
+#if _USE_FASTSEEK
+    fp->n_run = 0;        /* Runs past the new end are gone */
+#endif
     if (fp->fptr == 0) {  /* When set file size to zero, remove entire cluster chain */
       if (!remove_chain(fp->fs, fp->org_clust)) goto ft_error;
       fp->org_clust = 0;
@@ -2280,6 +3188,7 @@ FRESULT f_unlink (
 #else
   res = trace_path(&dj, fn, path, &dir);        /* trace the file path */
 #endif
+  path_cache_clear();                           /* Entries are about to move */
   if (res != FR_OK) return res;                 /* Trace failed */
   if (dir == NULL) return FR_INVALID_NAME;      /* It is the root directory */
   if (dir[DIR_Attr] & AM_RDO) return FR_DENIED; /* It is a R/O object */
@@ -2365,6 +3274,7 @@ FRESULT f_mkdir (
 #else
   res = trace_path(&dj, fn, path, &dir);       /* trace the file path */
 #endif
+  path_cache_clear();                          /* Entries are about to move */
   if (res == FR_OK) return FR_EXIST;           /* Any file or directory is already existing */
   if (res != FR_NO_FILE) return res;
 
@@ -2614,6 +3524,7 @@ FRESULT f_rename (
 #else
   res = trace_path(&dj, fn, path_old, &dir_old);       /* trace the file path */
 #endif
+  path_cache_clear();                                  /* Entries are about to move */
   if (res != FR_OK) return res;                        /* The old object is not found */
   if (!dir_old) return FR_NO_FILE;
   sect_old = FSBUF.sect;                               /* Save the object information */
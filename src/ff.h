@@ -96,6 +96,16 @@
 /  operate slower.  This option can only be set if _USE_FS_BUF is set.  */
 #define _USE_1_BUF 1
 
+/* Number of sector buffers when _USE_1_BUF is set.  With more than one,
+/  the first holds FAT and directory sectors and the others hold file data,
+/  recycled least recently used first, so open files and the FAT stop
+/  evicting each other.  Each buffer costs a little over 512 bytes of RAM. */
+#ifdef CONFIG_FF_CACHE_SLOTS
+#define _CACHE_SLOTS CONFIG_FF_CACHE_SLOTS
+#else
+#define _CACHE_SLOTS 1
+#endif
+
 /* If set to 1, FatFs will manage the FATFS structures after mounting.  If
 /  set to 0, the caller must send the correct drive FATFS structure for each
 /  call.  Normally, this should be set to 1, but if the caller wants to use
@@ -112,7 +122,49 @@
 #define _USE_TRUNCATE 0
 #define _USE_UTIME   0
 
+/* If set to 1, f_read_stream() and f_write_stream() are available.  They
+/  hand whole sectors of a file to a caller supplied function instead of
+/  copying them through memory, so the caller can move the data between
+/  the drive and its destination directly. */
+#ifdef CONFIG_SD_STREAMING
+#define _USE_STREAM 1
+#else
+#define _USE_STREAM 0
+#endif
+
+/* If set to n > 0, each open file remembers up to n runs of contiguous
+/  clusters as its chain is followed, and f_lseek() looks the target cluster
+/  up there instead of walking the FAT.  Costs 6n+1 bytes per FIL. */
+#ifdef CONFIG_FF_FASTSEEK
+#define _USE_FASTSEEK CONFIG_FF_FASTSEEK
+#else
+#define _USE_FASTSEEK 0
+#endif
+
+/* If set to n > 0, up to n runs of free clusters are kept in RAM.  They
+/  are found by f_scanfree() while the drive is idle and kept up to date as
+/  clusters are allocated and freed, so create_chain() does not have to
+/  search a nearly full FAT.  Costs 6n bytes. */
+#ifdef CONFIG_FF_FREE_RUNS
+#define _USE_FREE_RUNS CONFIG_FF_FREE_RUNS
+#else
+#define _USE_FREE_RUNS 0
+#endif
+
+/* If set to n > 0, the last n single 8.3 names found by trace_path() are
+/  remembered with the position of their directory entry, so opening them
+/  again reads a single directory sector.  Forgotten on rename, delete,
+/  mkdir and mount.  Costs 33 bytes per name. */
+#ifdef CONFIG_FF_PATH_CACHE
+#define _USE_PATH_CACHE CONFIG_FF_PATH_CACHE
+#else
+#define _USE_PATH_CACHE 0
+#endif
+
 #include "integer.h"
+#if _USE_STREAM
+#include "diskio.h"     /* DRESULT for the stream functions */
+#endif
 
 #if _USE_LFN_DBCS != 0
 #define S_LFN_OFFSET 26
@@ -135,16 +187,34 @@
 #define _USE_1_BUF 0
 #endif
 
+#if _CACHE_SLOTS > 1 && _USE_1_BUF == 0
+#error More than one cache slot needs _USE_1_BUF
+#endif
+
 typedef struct _BUF {
   DWORD sect;
   BYTE  dirty;              /* dirty flag (1:must be written back) */
 //BYTE  pad1;
 #if _USE_1_BUF != 0
   struct _FATFS *fs;
+#endif
+#if _USE_FS_BUF != 0
+  struct _FIL *owner;       /* file whose data is waiting to be written back */
+#endif
+#if _CACHE_SLOTS > 1
+  BYTE  age;                /* accesses to other slots since this one was used */
 #endif
   BYTE  data[S_MAX_SIZ];    /* Disk access window for Directory/FAT */
 } BUF;
 
+#if _USE_FREE_RUNS
+/* Run of free clusters */
+typedef struct _FFREE {
+    DWORD   clust;          /* First free cluster */
+    WORD    len;            /* Number of free clusters, 0 if unused */
+} FFREE;
+#endif
+
 /* File system object structure */
 typedef struct _FATFS {
   //WORD    id;             /* File system mount ID */
@@ -165,6 +235,10 @@ typedef struct _FATFS {
     BYTE    fsi_flag;       /* fsinfo dirty flag (1:must be written back) */
   //BYTE    pad2;
 #endif
+#if _USE_FREE_RUNS
+    DWORD   scan_clust;     /* Next cluster f_scanfree() looks at */
+    FFREE   free_run[_USE_FREE_RUNS];   /* Free clusters known */
+#endif
 #endif
     BYTE    fs_type;        /* FAT sub type */
     BYTE    csize;          /* Number of sectors per cluster */
@@ -190,6 +264,14 @@ typedef struct _DIR {
 
 
 /* File object structure */
+#if _USE_FASTSEEK
+/* Run of contiguous clusters in a file */
+typedef struct _FRUN {
+    DWORD   clust;          /* First cluster of the run */
+    WORD    end;            /* Cluster index in the file just past the run */
+} FRUN;
+#endif
+
 typedef struct _FIL {
   //WORD    id;             /* Owner file system mount ID */
     BYTE    flag;           /* File status flags */
@@ -207,6 +289,10 @@ typedef struct _FIL {
 #if _USE_LESS_BUF == 0 && _USE_1_BUF == 0
     BUF   buf;              /* File R/W buffer */
 #endif
+#if _USE_FASTSEEK
+    BYTE    n_run;          /* Number of runs known */
+    FRUN    run[_USE_FASTSEEK];   /* Cluster runs from the top of the file */
+#endif
 } FIL;
 
 
@@ -311,6 +397,23 @@ FRESULT f_chdir (const UCHAR*);                             /* Change current di
 
 #endif
 
+FRESULT f_read_window (FIL*, const BYTE**, UINT, UINT*);    /* Get file data in place from the file window */
+FRESULT f_unread_window (FIL*, UINT);                       /* Hand back data from the end of the last window read */
+FRESULT f_prefetch (FIL*);                                  /* Load the sector the next read starts in */
+FRESULT f_dirsig (const DIR*, DWORD*);                      /* Checksum the entries of a directory */
+FRESULT f_lseek_clust (FIL*, DWORD, DWORD);                 /* Move file pointer within a known cluster */
+#if !_FS_READONLY
+FRESULT f_write_zero (FIL*, DWORD, DWORD*);                 /* Write zeros to a file */
+#if _USE_FREE_RUNS
+UINT f_scanfree (FATFS*);                                   /* Look for free clusters in the background */
+#endif
+#endif
+
+#if _USE_STREAM
+FRESULT f_read_stream (FIL*, UINT, UINT*, DRESULT (*)(BYTE, DWORD));        /* Stream whole sectors out of a file */
+FRESULT f_write_stream (FIL*, UINT, UINT*, DRESULT (*)(BYTE, DWORD));       /* Stream whole sectors into a file */
+#endif
+
 /* Low Level functions */
 FRESULT l_opendir(FATFS* fs, DWORD cluster, DIR *dirobj);   /* Open an existing directory by its start cluster */
 FRESULT l_opencluster(FATFS *fs, FIL *fp, DWORD clust);     /* Open a cluster by number as a read-only file */
@@ -18,11 +18,129 @@
     hexbus.c: Routines to support the Texas Instruments HexBus protocol
 */
 
+#include <stddef.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
 #include <util/delay.h>
 #include "config.h"
 #include "integer.h"
 #include "uart.h"
 #include "hexbus.h"
+#include "trace.h"
+#ifdef CONFIG_HEXBUS_TIMING
+#include "eeprom.h"
+#endif
+
+#ifdef CONFIG_HEXBUS_TIMING
+/*
+   Bus timing profiles.
+   The bus spec asks for 8 us HSK hold times, and 2 us to let a
+   released line rise without the 8.2k pullups.  Most hosts and
+   boards are a good deal quicker than that, so the delays are
+   taken from the selected profile instead.  In HEXTIMING_AUTO
+   mode the first transactions after reset run with spec timing
+   while the host's HSK turnaround and our line rise time are
+   measured, and the delays are then derived from those.
+*/
+#define HEX_HOLD_MAX      8   // us, bus spec
+#define HEX_HOLD_MIN      2   // us, never go below this whatever we measure
+#define HEX_HOLD_FAST     3
+#define HEX_RELEASE_MAX   2   // us, rise time w/o the 8.2k pullups
+#define HEX_RELEASE_FAST  1
+#define HEX_CAL_SAMPLES   32  // host turnarounds measured per calibration
+
+// _delay_loop_1() takes 3 cycles per count
+#define US_TO_LOOPS(us)   ((uint8_t)(((us) * (F_CPU / 100000UL) + 29) / 30))
+#define TICKS_TO_US(t)    ((uint8_t)(((uint32_t)(t) * HEX_CAL_PRESCALE * 1000000UL + F_CPU - 1) / F_CPU))
+
+static uint8_t hex_hold = US_TO_LOOPS(HEX_HOLD_MAX);
+static uint8_t hex_release = US_TO_LOOPS(HEX_RELEASE_MAX);
+static uint8_t cal_left;    // samples still to take, 0 = not calibrating
+static uint8_t cal_turn;    // longest host turnaround, in timer ticks
+static uint8_t cal_rise;    // longest line rise time + 1, in timer ticks, 0 = none seen
+
+#define hex_hold_delay()    _delay_loop_1(hex_hold)
+#define hex_release_delay() _delay_loop_1(hex_release)
+
+static void hex_apply_timing( uint8_t hold, uint8_t release ) {
+  if ( hold < HEX_HOLD_MIN )
+    hold = HEX_HOLD_MIN;
+  if ( hold > HEX_HOLD_MAX )
+    hold = HEX_HOLD_MAX;
+  if ( !release )
+    release = HEX_RELEASE_FAST;
+  if ( release > HEX_RELEASE_MAX )
+    release = HEX_RELEASE_MAX;
+  hex_hold = US_TO_LOOPS(hold);
+  hex_release = US_TO_LOOPS(release);
+}
+
+/*
+   hex_calibrate() -
+   fall back to spec timing and measure the next HEX_CAL_SAMPLES
+   host turnarounds.
+*/
+static void hex_calibrate( void ) {
+  hex_apply_timing( HEX_HOLD_MAX, HEX_RELEASE_MAX );
+  cal_turn = 0;
+  cal_rise = 0;
+  cal_left = HEX_CAL_SAMPLES;
+  cal_timer_start();
+}
+
+/*
+   hex_cal_sample() -
+   record one host turnaround.  The host reacts to HSK edges at
+   least as fast as it turns a nibble around, so once enough
+   samples are in, hold HSK for the slowest turnaround seen plus
+   a microsecond of margin.  If the timer never moved, the
+   measurement failed and spec timing stays in place.
+*/
+static void hex_cal_sample( uint16_t ticks ) {
+  if ( ticks > cal_turn )
+    cal_turn = ( ticks > 255 ? 255 : ticks );
+  if ( !--cal_left ) {
+    cal_timer_stop();
+    if ( !cal_turn ) {
+      _config.hex_hold = 0;   // no result, CAL measures again
+      return;
+    }
+    _config.hex_hold = TICKS_TO_US( cal_turn ) + 1;
+    _config.hex_release = ( cal_rise ? TICKS_TO_US( cal_rise ) : HEX_RELEASE_MAX );
+    hex_apply_timing( _config.hex_hold, _config.hex_release );
+  }
+}
+
+/*
+   hex_set_timing() -
+   select a bus timing profile.  HEXTIMING_CAL uses the values
+   from the last calibration, or runs one if there are none.
+*/
+void hex_set_timing( uint8_t profile ) {
+  cal_left = 0;
+  cal_timer_stop();
+  switch ( profile ) {
+  case HEXTIMING_SPEC:
+    hex_apply_timing( HEX_HOLD_MAX, HEX_RELEASE_MAX );
+    break;
+  case HEXTIMING_FAST:
+    hex_apply_timing( HEX_HOLD_FAST, HEX_RELEASE_FAST );
+    break;
+  case HEXTIMING_CAL:
+    if ( _config.hex_hold ) {
+      hex_apply_timing( _config.hex_hold, _config.hex_release );
+      break;
+    }
+    // no stored result, fall through and measure one
+  default:
+    hex_calibrate();
+    break;
+  }
+}
+#else
+#define hex_hold_delay()    _delay_us(8)
+#define hex_release_delay() _delay_us(2)
+#endif
 
 /*
    hex_is_bav() -
@@ -43,7 +161,7 @@ uint8_t hex_is_bav(void) {
 static void hex_bav_hi(void) {
   HEX_BAV_DDR &= ~HEX_BAV_PIN;   // HI-Z BAV
   HEX_BAV_OUT |= HEX_BAV_PIN;    // Bring pullups online
-  _delay_us(2);                  // Allow signal to reach HI-Z (need delay since we do not monitor this)
+  hex_release_delay();           // Allow signal to reach HI-Z (need delay since we do not monitor this)
 }
 
 /*
@@ -97,7 +215,20 @@ static uint8_t hex_is_hsk(void) {
 void hex_release_data( void ) {
   HEX_DATA_DDR &= ~HEX_DATA_PIN;   // HI-Z data lines.
   HEX_DATA_OUT |= HEX_DATA_PIN;    // ensure output latches are set.
-  _delay_us(2);                    // lets line raise. need delay since we do not monitor these
+#ifdef CONFIG_HEXBUS_TIMING
+  if ( cal_left ) {
+    // time the rise while calibrating, give up well past the spec value
+    uint16_t ticks;
+
+    HEX_CAL_TIMER = 0;
+    do {
+      ticks = HEX_CAL_TIMER;
+    } while ( (HEX_DATA_IN & HEX_DATA_PIN) != HEX_DATA_PIN && ticks < 254 );
+    if ( ticks >= cal_rise )
+      cal_rise = ( ticks < 254 ? ticks : 254 ) + 1;
+  }
+#endif
+  hex_release_delay();             // lets line raise. need delay since we do not monitor these
   // w/o pullups of 8.2k, 2 us is enough.
   return;
 }
@@ -208,6 +339,10 @@ lowhsk:  // Host has driven HSK low. Peripheral side must now hold it low.
   // Peripheral side release of HSK, wait for host to also release.
   // This manages to let host guarantee bus timing w/o local delays
   hex_release_bus();
+#ifdef CONFIG_HEXBUS_TIMING
+  if ( cal_left )
+    HEX_CAL_TIMER = 0;
+#endif
 
   // wait for next host-side drive of HSK low
   do
@@ -220,6 +355,12 @@ lowhsk:  // Host has driven HSK low. Peripheral side must now hold it low.
   hex_hsk_lo();
   // read data nibble for upper 4 bits of data.
   msn = (HEX_DATA_IN & HEX_DATA_PIN); // MSN
+#ifdef CONFIG_HEXBUS_TIMING
+  if ( cal_left ) {
+    // HSK is held low, so the host waits while we take the sample
+    hex_cal_sample( HEX_CAL_TIMER );
+  }
+#endif
   msn <<= 4;
   // build our response data and return success
   // We leave it held low for our next byte receipt to release.
@@ -229,66 +370,365 @@ lowhsk:  // Host has driven HSK low. Peripheral side must now hold it low.
 }
 
 /*
-   hex_send_byte() -
-   send 1 byte over bus.  holds BAV lo throughout.
-   when we are completed, we will externally release BAV to let
-   host know we are done with response frame.
+   hex_recv_nibbles() -
+   shared body of the hex_recv_*() block functions.
+   Receives len bytes that continue a message into buf, or hands
+   them to put if buf is NULL, or drops them if both are NULL.
+   HSK is expected to be held low by us from the previous byte,
+   and is left held low after the last byte, exactly as
+   hex_recv_byte() does.  Inlined into each caller so the
+   destination tests fold away.
+*/
+static inline __attribute__((always_inline)) hexerror_t hex_recv_nibbles( uint8_t *buf, void (*put)(uint8_t), uint16_t len )
+{
+  uint8_t lsn, msn;
 
+  trace_in( len );
+  while ( len-- ) {
+    // release HSK from the previous nibble, wait for host to drive it low
+    hex_release_bus();
+    if ( hex_wait_for_hsk_lo() ) {
+      return HEXERR_BAV;
+    }
+    hex_hsk_lo();
+    lsn = (HEX_DATA_IN & HEX_DATA_PIN);
+    hex_release_bus();
+    if ( hex_wait_for_hsk_lo() ) {
+      return HEXERR_BAV;
+    }
+    hex_hsk_lo();
+    msn = (HEX_DATA_IN & HEX_DATA_PIN);
+    if ( buf != NULL ) {
+      *buf++ = (msn << 4) | lsn;
+    } else if ( put != NULL ) {
+      // HSK is held low, so the host waits for us while put() runs
+      put( (msn << 4) | lsn );
+    }
+  }
+  return HEXERR_SUCCESS;
+}
+
+/*
+   hex_recv_block() -
+   receive len bytes of an incoming message directly into buf.
+   HSK stays under our control across the whole block, and is
+   left held low after the last byte for the caller to release.
+   return value is status (HEXERR_BAV or HEXERR_SUCCESS)
+*/
+hexerror_t hex_recv_block( uint8_t *buf, uint16_t len )
+{
+  return hex_recv_nibbles( buf, NULL, len );
+}
+
+/*
+   hex_recv_discard() -
+   same as hex_recv_block(), but the data is thrown away.
+   Used to drain data we cannot accept before sending an error.
 */
+hexerror_t hex_recv_discard( uint16_t len )
+{
+  return hex_recv_nibbles( NULL, NULL, len );
+}
 
-hexerror_t hex_send_byte( uint8_t xmit )
+#ifdef CONFIG_SD_STREAMING
+/*
+   hex_recv_stream() -
+   same as hex_recv_block(), but each byte is handed to put()
+   as soon as it has arrived instead of being stored.
+*/
+hexerror_t hex_recv_stream( void (*put)(uint8_t), uint16_t len )
 {
-  uint8_t nibble = xmit;
+  return hex_recv_nibbles( NULL, put, len );
+}
+#endif
+
+#ifdef CONFIG_HEXBUS_IRQ
+/*
+   Interrupt driven receive engine.
+   The HSK falling edge interrupt grabs each nibble the host sends
+   and packs the bytes into one of two ping-pong buffers.  When a
+   buffer is full it is handed to the main loop and the other one
+   is filled.  If the main loop still owns the other buffer, HSK is
+   simply held low until it is handed back, which stalls the host
+   without losing data.
+   Sending stays polled.  Each nibble waits for the host's HSK, so
+   there is nothing for a timer to pace, and the main loop has no
+   other work while it answers a request.  Timer 1 is only powered
+   while the bus timing is calibrated, so it is not used here.
+*/
+static uint8_t          *irq_base;      // first of the two buffers
+static uint8_t          irq_size;       // size of each buffer
+static uint8_t          irq_drain;      // buffer the main loop gets next
+static volatile uint16_t irq_left;      // bytes still to come from the host
+static volatile uint8_t irq_ready[2];   // bytes waiting in each buffer, 0 = free
+static volatile uint8_t irq_fill;       // buffer the ISR fills
+static volatile uint8_t irq_pos;        // fill position in that buffer
+static volatile uint8_t irq_lsn;        // low nibble of the byte in progress
+static volatile uint8_t irq_msn;        // TRUE if the high nibble comes next
+static volatile uint8_t irq_stalled;    // TRUE if HSK is held for a free buffer
+
+#endif
+
+#if defined CONFIG_HEXBUS_IRQ || defined CONFIG_IDLE_TASKS
+#ifdef CONFIG_IDLE_TASKS
+static volatile uint8_t hsk_idle;       // TRUE while the main loop does idle work
+#endif
+
+HSK_HANDLER {
+#ifdef CONFIG_HEXBUS_IRQ
+  uint8_t nibble;
+  uint8_t fill;
+#endif
+
+  // host has driven HSK low, hold it low from our side right away
+  HEX_HSK_OUT &= ~HEX_HSK_PIN;
+  HEX_HSK_DDR |= HEX_HSK_PIN;
+#ifdef CONFIG_IDLE_TASKS
+  if ( hsk_idle ) {
+    // a transaction started during idle work, the host waits until we get to it
+    hsk_irq_disable();
+    return;
+  }
+#endif
+#ifdef CONFIG_HEXBUS_IRQ
+  nibble = HEX_DATA_IN & HEX_DATA_PIN;
+  if ( !irq_msn ) {
+    irq_lsn = nibble;
+    irq_msn = TRUE;
+    hex_hsk_hi();
+    return;
+  }
+  irq_msn = FALSE;
+  fill = irq_fill;
+  irq_base[ fill * irq_size + irq_pos++ ] = (nibble << 4) | irq_lsn;
+  if ( !--irq_left ) {
+    // last byte: hand over the buffer and leave HSK low, as hex_recv_block() does
+    irq_ready[ fill ] = irq_pos;
+    hsk_irq_disable();
+    return;
+  }
+  if ( irq_pos == irq_size ) {
+    irq_ready[ fill ] = irq_pos;
+    irq_pos = 0;
+    fill ^= 1;
+    irq_fill = fill;
+    if ( irq_ready[ fill ] ) {
+      // main loop still has the other buffer, keep the host waiting
+      irq_stalled = TRUE;
+      return;
+    }
+  }
+  hex_hsk_hi();
+#endif
+}
+#endif
 
+#ifdef CONFIG_IDLE_TASKS
+/*
+   hex_idle_start() -
+   the main loop is about to do work that may take longer than the
+   host allows us to answer HSK.  Until hex_idle_end(), a falling HSK
+   is caught in the interrupt and held low, so the transaction simply
+   waits, as it does after hex_capture_hsk().
+*/
+void hex_idle_start( void ) {
+  hsk_idle = TRUE;
+  hsk_irq_enable();
+}
+
+/*
+   hex_idle_end() -
+   stop catching HSK for idle work.
+*/
+void hex_idle_end( void ) {
+  hsk_irq_disable();
+  hsk_idle = FALSE;
+}
+#endif
+
+#ifdef CONFIG_HEXBUS_IRQ
+/*
+   hex_irq_recv_start() -
+   start receiving len bytes that continue a message in the
+   background, into two buffers of size bytes starting at buf.
+   HSK must be held low by us, as after hex_recv_byte().
+*/
+void hex_irq_recv_start( uint8_t *buf, uint8_t size, uint16_t len ) {
+  irq_base = buf;
+  irq_size = size;
+  irq_drain = 0;
+  irq_left = len;
+  irq_ready[0] = 0;
+  irq_ready[1] = 0;
+  irq_fill = 0;
+  irq_pos = 0;
+  irq_msn = FALSE;
+  irq_stalled = FALSE;
+  trace_in( len );
+  if ( len ) {
+    hsk_irq_enable();
+    // let the host send the first nibble
+    hex_hsk_hi();
+  }
+}
+
+/*
+   hex_irq_recv_get() -
+   wait for the next buffer filled by the receive engine.
+   stores a pointer to the data in buf and returns the number
+   of bytes in it, or returns 0 if the host dropped BAV.
+*/
+uint8_t hex_irq_recv_get( uint8_t **buf ) {
+  uint8_t count;
+
+  while ( !(count = irq_ready[ irq_drain ]) ) {
+    if ( hex_is_bav() ) {
+      hsk_irq_disable();
+      return 0;
+    }
+  }
+  *buf = irq_base + irq_drain * irq_size;
+  return count;
+}
+
+/*
+   hex_irq_recv_release() -
+   hand the buffer returned by hex_irq_recv_get() back to the
+   receive engine, and let the host continue if it was stalled.
+*/
+void hex_irq_recv_release( void ) {
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    irq_ready[ irq_drain ] = 0;
+    irq_drain ^= 1;
+    if ( irq_stalled ) {
+      irq_stalled = FALSE;
+      hex_hsk_hi();
+    }
+  }
+}
+#endif
+
+/*
+   hex_send_nibbles() -
+   shared body of the hex_send_*() block functions.
+   Sends len bytes from buf, or fetched by calling get if buf
+   is NULL.  BAV is driven low once for the whole block, and
+   the port/DDR values for both nibbles of a byte are computed
+   before the handshake starts, so the only time spent per byte
+   is the 8 us minimums required by the bus spec.
+   when we are completed, we will externally release BAV to let
+   host know we are done with response frame.
+*/
+static inline __attribute__((always_inline)) hexerror_t hex_send_nibbles( const uint8_t *buf, uint8_t (*get)(void), uint16_t len )
+{
+  uint8_t data;
+  uint8_t port, ddr;
+  uint8_t lsn_out, lsn_ddr, msn_out, msn_ddr;
+
+  trace_out( len );
   // Hold BAV low to initiate response if not already low
   hex_bav_lo();
-  // release HSK to HI-Z and wait for host to release high as well
-  hex_release_bus();
-  // hi, wait 8 us interbyte timing as required by bus spec
-  _delay_us(8);
-  nibble &= 0x0f;
-  // place LSN of data on output lines
-  HEX_DATA_OUT = (HEX_DATA_OUT & ~HEX_DATA_PIN) | nibble;
-  HEX_DATA_DDR = (HEX_DATA_OUT & ~HEX_DATA_PIN) | (~nibble & HEX_DATA_PIN);
-  // signal HSK low to indicate to host that data is available
-  hex_hsk_lo();  // drive low
-  // hold HSK low at least 8 us for bus timing
-  _delay_us(8);
-  // then, release HSK to HI-Z and wait for host to release as well
-  hex_release_bus();
-  // go grab the MSN nibble to send
-  nibble = xmit;
-  nibble >>= 4;
-  nibble &= 0x0f;
-  // ensure we have at least 8 us high per bus spec.
-  _delay_us(8);
-  // place MSN of data on output lines
-  HEX_DATA_OUT = (HEX_DATA_OUT & ~HEX_DATA_PIN) | nibble;
-  HEX_DATA_DDR = (HEX_DATA_OUT & ~HEX_DATA_PIN) | (~nibble & HEX_DATA_PIN);
-  // drive HSK low to signal data available to host system and hold it.
-  hex_hsk_lo();
-  // guarantee we are low at least 8 us bus timing
-  _delay_us(8);
+  // non-data bits of the data port do not change during a transfer
+  port = HEX_DATA_OUT & ~HEX_DATA_PIN;
+  ddr = HEX_DATA_DDR & ~HEX_DATA_PIN;
+  while ( len-- ) {
+    data = ( buf != NULL ? *buf++ : get() );
+    // precompute output latch and direction values for both nibbles
+    lsn_out = port | (data & HEX_DATA_PIN);
+    lsn_ddr = ddr | (~data & HEX_DATA_PIN);
+    data >>= 4;
+    msn_out = port | data;
+    msn_ddr = ddr | (~data & HEX_DATA_PIN);
+    // release HSK to HI-Z and wait for host to release high as well
+    hex_release_bus();
+    // hi, wait 8 us interbyte timing as required by bus spec
+    hex_hold_delay();
+    // place LSN of data on output lines
+    HEX_DATA_OUT = lsn_out;
+    HEX_DATA_DDR = lsn_ddr;
+    // signal HSK low to indicate to host that data is available
+    hex_hsk_lo();  // drive low
+    // hold HSK low at least 8 us for bus timing
+    hex_hold_delay();
+    // then, release HSK to HI-Z and wait for host to release as well
+    hex_release_bus();
+    // ensure we have at least 8 us high per bus spec.
+    hex_hold_delay();
+    // place MSN of data on output lines
+    HEX_DATA_OUT = msn_out;
+    HEX_DATA_DDR = msn_ddr;
+    // drive HSK low to signal data available to host system and hold it.
+    hex_hsk_lo();
+    // guarantee we are low at least 8 us bus timing
+    hex_hold_delay();
+  }
   return HEXERR_SUCCESS;
 }
 
 
+/*
+   hex_send_block() -
+   send len bytes from buf over bus.  holds BAV lo throughout.
+*/
+hexerror_t hex_send_block( const uint8_t *buf, uint16_t len )
+{
+  return hex_send_nibbles( buf, NULL, len );
+}
+
+
+#ifdef CONFIG_SD_STREAMING
+/*
+   hex_send_stream() -
+   send len bytes over bus, fetching each one from get() just
+   before it is needed.  A source that starts fetching the next
+   byte in hardware before returning, like an SPI transfer, runs
+   in parallel with the bus hold times of the current byte.
+*/
+hexerror_t hex_send_stream( uint8_t (*get)(void), uint16_t len )
+{
+  return hex_send_nibbles( NULL, get, len );
+}
+#endif
+
+
+/*
+   hex_send_byte() -
+   send 1 byte over bus.  holds BAV lo throughout.
+*/
+hexerror_t hex_send_byte( uint8_t xmit )
+{
+  return hex_send_block( &xmit, 1 );
+}
+
+
 /*
    hex_send_word() -
-   use hex_send_byte() to send LSB/MSB of a word over the bus.
+   send LSB/MSB of a word over the bus.
 */
 hexerror_t hex_send_word( uint16_t value )
 {
-  hexerror_t rc;
+  uint8_t data[2];
+
+  data[0] = value & 0xff;   // LSB of word
+  data[1] = value >> 8;     // MSB of word
+  return hex_send_block( data, sizeof(data) );
+}
+
 
-  // Send LSB of word over bus
-  rc = hex_send_byte( value & 0xff );
-  if ( rc == HEXERR_SUCCESS ) {
-    // Send MSB of word over bus
-    rc = hex_send_byte( value >> 8 );
+/*
+   hex_send_response() -
+   send a complete response frame: the length of the data,
+   len bytes of data from buf and the status code, then
+   release and finish up the bus cycle.
+*/
+void hex_send_response( uint16_t len, const uint8_t *buf, hexstatus_t rc ) {
+  if (!hex_is_bav() ) { // we can send response
+    trace_status( rc );
+    hex_send_word( len );
+    hex_send_block( buf, len );
+    hex_send_byte( rc );
   }
-  // return to caller.
-  return rc;
+  hex_finish();
 }
 
 /*
@@ -299,13 +739,13 @@ hexerror_t hex_send_word( uint16_t value )
    * a success status response.
 */
 void hex_send_size_response( uint16_t len , uint16_t record) {
-  if (!hex_is_bav() ) { // we can send response
-    hex_send_word( 4 );
-    hex_send_word( len );
-    hex_send_word( record );
-    hex_send_byte( HEXERR_SUCCESS );
-  }
-  hex_finish();
+  uint8_t data[4];
+
+  data[0] = len & 0xff;
+  data[1] = len >> 8;
+  data[2] = record & 0xff;
+  data[3] = record >> 8;
+  hex_send_response( sizeof(data), data, HEXSTAT_SUCCESS );
 }
 
 /*
@@ -317,6 +757,7 @@ void hex_send_size_response( uint16_t len , uint16_t record) {
 */
 void hex_send_final_response( hexstatus_t rc ) {
   if (!hex_is_bav() ) { // we can send response
+    trace_status( rc );
     hex_send_word( 0 );
     hex_send_byte( rc );
   }
@@ -350,4 +791,7 @@ void hex_init(void) {
 
   HEX_DATA_DDR &= ~HEX_DATA_PIN;
   HEX_DATA_OUT |= HEX_DATA_PIN;
+#ifdef CONFIG_HEXBUS_TIMING
+  hex_set_timing( _config.hex_timing );
+#endif
 }
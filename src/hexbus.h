@@ -138,17 +138,45 @@ typedef enum _openmode_t {
 #define    FILE_IO_MODE_READONLY    0x01
 #define    FILE_REQ_STATUS_NONE     0x00
 
+typedef enum _hextiming_t {
+              HEXTIMING_AUTO = 0,   // calibrate against the host after each reset
+              HEXTIMING_SPEC,       // bus spec worst case, 8 us hold, 2 us release
+              HEXTIMING_FAST,       // 8.2k pullups and a quick host
+              HEXTIMING_CAL,        // stored result of the last calibration
+              HEXTIMING_MAX
+            } hextiming_t;
+
 
 uint8_t hex_is_bav(void);
 void hex_release_bus(void);
 hexerror_t hex_capture_hsk( void );
 hexerror_t hex_recv_byte( uint8_t *inout);
+hexerror_t hex_recv_block( uint8_t *buf, uint16_t len );
+hexerror_t hex_recv_discard( uint16_t len );
+#ifdef CONFIG_HEXBUS_IRQ
+void hex_irq_recv_start( uint8_t *buf, uint8_t size, uint16_t len );
+uint8_t hex_irq_recv_get( uint8_t **buf );
+void hex_irq_recv_release( void );
+#endif
+#ifdef CONFIG_IDLE_TASKS
+void hex_idle_start( void );
+void hex_idle_end( void );
+#endif
+#ifdef CONFIG_SD_STREAMING
+hexerror_t hex_recv_stream( void (*put)(uint8_t), uint16_t len );
+hexerror_t hex_send_stream( uint8_t (*get)(void), uint16_t len );
+#endif
+hexerror_t hex_send_block( const uint8_t *buf, uint16_t len );
 hexerror_t hex_send_byte( uint8_t xmit );
 hexerror_t hex_send_word( uint16_t value );
 void hex_finish( void );
+void hex_send_response( uint16_t len, const uint8_t *buf, hexstatus_t rc );
 void hex_send_size_response( uint16_t len , uint16_t record);
 void hex_send_final_response( hexstatus_t rc );
 void hex_init(void);
+#ifdef CONFIG_HEXBUS_TIMING
+void hex_set_timing( uint8_t profile );
+#endif
 
 #ifdef __cplusplus
 } // extern "C"
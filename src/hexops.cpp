@@ -28,6 +28,7 @@
 #include "hexops.h"
 #include "registry.h"
 #include "timer.h"
+#include "trace.h"
 #include "uart.h"
 #include "hexops.h"
 
@@ -98,14 +99,10 @@ uint8_t parse_number(char** buf, uint8_t *len, uint8_t digits, uint32_t* value)
 
 
 hexstatus_t hex_get_data(uint8_t *buf, uint16_t len) {
-  uint16_t i = 0;
 
-  while (i < len) {
-    buf[ i ] = 1;
-    if(hex_recv_byte( &buf[ i++ ] ) != HEXERR_SUCCESS) {
-      // TODO probably should define what errors could happen
-      return HEXSTAT_DATA_ERR;
-    }
+  if(hex_recv_block( buf, len ) != HEXERR_SUCCESS) {
+    // TODO probably should define what errors could happen
+    return HEXSTAT_DATA_ERR;
   }
   if (len > 0) {
     debug_trace(buf, 0, len);
@@ -114,18 +111,38 @@ hexstatus_t hex_get_data(uint8_t *buf, uint16_t len) {
 }
 
 
+#ifdef CONFIG_HEXBUS_IRQ
+/*
+   hex_get_stream() -
+   receive len bytes in the background, handing each half of
+   the shared buffer to sink as soon as it fills.  The host keeps
+   sending into one half while sink works on the other.
+*/
+hexstatus_t hex_get_stream(uint16_t len, void (*sink)(uint8_t *data, uint8_t len)) {
+  uint8_t *data;
+  uint8_t count;
+
+  hex_irq_recv_start(buffer, (BUFSIZE + 1) / 2, len);
+  while (len) {
+    count = hex_irq_recv_get(&data);
+    if (!count) {
+      return HEXSTAT_DATA_ERR;
+    }
+    debug_trace(data, 0, count);
+    sink(data, count);
+    len -= count;
+    hex_irq_recv_release();
+  }
+  return HEXSTAT_SUCCESS;
+}
+#endif
+
+
 void hex_eat_it(uint16_t length, hexstatus_t status )
 {
-  uint16_t i = 0;
-  uint8_t  data;
-
-  while ( i < length ) {
-    data = 1;
-    if ( hex_recv_byte( &data ) != HEXERR_SUCCESS ) {
-      hex_release_bus();
-      return;
-    }
-    i++;
+  if ( hex_recv_discard( length ) != HEXERR_SUCCESS ) {
+    hex_release_bus();
+    return;
   }
   // safe to turn around now.  As long as BAV is still
   // low, then go ahead and send a response.
@@ -290,7 +307,10 @@ void hex_finish_open(uint16_t len, hexstatus_t rc) {
 typedef enum _execcmd_t {
   EXEC_CMD_NONE = 0,
   EXEC_CMD_DEV,
-  EXEC_CMD_STORE
+  EXEC_CMD_STORE,
+  EXEC_CMD_TIMING,
+  EXEC_CMD_CAL,
+  EXEC_CMD_TRACE
 } execcmd_t;
 
 static const action_t cmds[] MEM_CLASS = {
@@ -298,10 +318,24 @@ static const action_t cmds[] MEM_CLASS = {
                                         {EXEC_CMD_DEV,"dev"},
                                         {EXEC_CMD_STORE,"st"},
                                         {EXEC_CMD_STORE,"store"},
+#ifdef CONFIG_HEXBUS_TIMING
+                                        {EXEC_CMD_TIMING,"ti"},
+                                        {EXEC_CMD_TIMING,"timing"},
+                                        {EXEC_CMD_CAL,"ca"},
+                                        {EXEC_CMD_CAL,"cal"},
+#endif
+#ifdef CONFIG_HEXBUS_TRACE
+                                        {EXEC_CMD_TRACE,"tr"},
+                                        {EXEC_CMD_TRACE,"trace"},
+#endif
                                         {EXEC_CMD_NONE,""}
                                        };
 
 
+#ifdef CONFIG_HEXBUS_TRACE
+static uint8_t read_trace;
+#endif
+
 // should be of the form "set <parm>=<value>"
 hexstatus_t hex_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
   hexstatus_t rc = HEXSTAT_SUCCESS;
@@ -322,6 +356,20 @@ hexstatus_t hex_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
   case EXEC_CMD_STORE:
     ee_set_config();
     break;
+#ifdef CONFIG_HEXBUS_TIMING
+  case EXEC_CMD_CAL:
+    // measure the host again and keep the result as the CAL profile
+    _config.hex_timing = HEXTIMING_CAL;
+    _config.hex_hold = 0;
+    hex_set_timing(HEXTIMING_CAL);
+    break;
+#endif
+#ifdef CONFIG_HEXBUS_TRACE
+  case EXEC_CMD_TRACE:
+    // next status read returns the transaction trace
+    read_trace = TRUE;
+    break;
+#endif
   default:
     cmd = (execcmd_t)parse_equate(cmds, &buf, &len);
     switch(cmd) {
@@ -337,6 +385,7 @@ hexstatus_t hex_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
                   && (registry.entry[i].dev_high >= (uint8_t)value)
                 ) {
                 registry.entry[i].dev_cur = (uint8_t)value;
+                reg_index();
                 *dev = (uint8_t)value;
                 rc = HEXSTAT_SUCCESS;
                 break;
@@ -348,6 +397,19 @@ hexstatus_t hex_exec_cmd(char* buf, uint8_t len, uint8_t *dev) {
         rc = HEXSTAT_DATA_INVALID;
       }
       break;
+#ifdef CONFIG_HEXBUS_TIMING
+    case EXEC_CMD_TIMING:
+      rc = HEXSTAT_DATA_ERR;
+      if(!parse_number(&buf, &len, 1, &value)) {
+        rc = HEXSTAT_DATA_INVALID;
+        if(value < HEXTIMING_MAX) {
+          _config.hex_timing = (uint8_t)value;
+          hex_set_timing((uint8_t)value);
+          rc = HEXSTAT_SUCCESS;
+        }
+      }
+      break;
+#endif
     default:
       // error
       rc = HEXSTAT_OPTION_ERR;
@@ -418,16 +480,16 @@ void hex_close_cmd(void) {
 #define STRLEN(s) ( (sizeof(s)/sizeof(s[0])) - sizeof(s[0]))
 const char _version[] PROGMEM = "" VERSION " [" TOSTRING(CONFIG_HARDWARE_NAME) "]";
 
-void hex_read_status(void) {
-  hexstatus_t rc;
-  uint8_t i;
-
-  rc = (hex_send_word( STRLEN(_version) ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
-  for (i = 0; rc == HEXSTAT_SUCCESS && i < STRLEN(_version); i++) {
-    rc = (hex_send_byte(pgm_read_byte(&_version[i])) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
+void hex_read_status(pab_t *pab) {
+#ifdef CONFIG_HEXBUS_TRACE
+  if (read_trace) {
+    read_trace = FALSE;
+    hex_send_response( trace_dump(buffer, pab->buflen), buffer, HEXSTAT_SUCCESS );
+    return;
   }
-  hex_send_byte(rc);
-  hex_finish();
+#endif
+  memcpy_P(buffer, _version, STRLEN(_version));
+  hex_send_response( STRLEN(_version), buffer, HEXSTAT_SUCCESS );
 }
 
 
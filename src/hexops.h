@@ -67,6 +67,9 @@ typedef struct _pab_raw_t {
 #define FILEATTR_RELATIVE 32
 
 hexstatus_t hex_get_data(uint8_t buf[256], uint16_t len);
+#ifdef CONFIG_HEXBUS_IRQ
+hexstatus_t hex_get_stream(uint16_t len, void (*sink)(uint8_t *data, uint8_t len));
+#endif
 void hex_eat_it(uint16_t length, hexstatus_t rc);
 void hex_unsupported(pab_t *pab);
 void hex_null(pab_t *pab __attribute__((unused)));
@@ -82,7 +85,7 @@ void hex_finish_open(uint16_t len, hexstatus_t rc);
 void hex_write_cmd(pab_t *pab, uint8_t *dev);
 void hex_close_cmd(void);
 hexstatus_t hex_write_cmd_helper(uint16_t len);
-void hex_read_status(void);
+void hex_read_status(pab_t *pab);
 hexstatus_t hex_open_helper(pab_t *pab, hexstatus_t err, uint16_t *len, uint8_t *att);
 
 #endif  // hexops_h
@@ -39,6 +39,7 @@
 #include "serial.h"
 #include "swuart.h"
 #include "timer.h"
+#include "trace.h"
 #include "uart.h"
 
 // Our registry of installed devices, built during initialization.
@@ -71,62 +72,42 @@ static void hex_reset_bus(pab_t *pab __attribute__((unused))) {
 
 
 static void execute_command(pab_t *pab) {
-  cmd_proc  handler;
-  cmd_op_t  *op;
-  uint8_t   i = 0;
-  uint8_t   j;
-  uint8_t   cmd;
-
-  while ( i < registry.num_devices ) {
-    // does the incoming PAB have a device in this group in the registry?
-    if ( registry.entry[ i ].dev_cur == pab->dev ) {
-      // If so...
-      // this entry will handle our device code.
-      // Search for a matching command index now.
-      op = registry.entry[ i ].oplist;
-      j = 0;
-      // Find a matching command code in this device's table, if present
-      do {
-        cmd = pgm_read_byte( &op[j].command );
-        j++;
-      } while ( ( cmd != HEXCMD_INVALID_MARKER ) && cmd != pab->cmd );
-      // If we found the command, we have the index to the operations routine
-      if ( cmd == pab->cmd ) {
-        // found it!
-        j--;  // here's the cmd index
-        // fetch the handler for this command for this device group.
-        handler = (cmd_proc)pgm_read_word( &op[j].operation );
-        (handler)( pab );
-        // and exit the command processor
-        return;
-      }
-      // If we have a supported device but not a supported command...
-      hex_unsupported(pab);
-      // we report and unsupported command and return
-      return;
-    }
-    // otherwise; let's move to possibly the next device group in the registry
-    i++;
+  registry_entry_t *entry;
+  cmd_proc  handler = NULL;
+  uint8_t   slot;
+
+  entry = reg_find( pab->dev );
+  if ( entry == NULL ) {
+    // If the device is not supported at all, then treat as a null.
+    // Release the HSK line and simply wait for BAV to go high indicating end of message.
+    // This is the best we can do, as someone else may be acting on this message.
+    hex_null(pab);
+    return;
+  }
+  // this entry will handle our device code, the command indexes its table directly.
+  slot = REG_CMD_SLOT( pab->cmd );
+  if ( slot < entry->num_ops ) {
+    handler = (cmd_proc)pgm_read_word( &entry->ops[ slot ] );
   }
-  // If the device is not supported at all, then treat as a null.
-  // Release the HSK line and simply wait for BAV to go high indicating end of message.
-  // This is the best we can do, as someone else may be acting on this message.
-  hex_null(pab);
+  if ( handler == NULL ) {
+    // If we have a supported device but not a supported command...
+    handler = hex_unsupported;
+  }
+  (handler)( pab );
 }
 
 
 //
 // Default registry for global bus support (device 0).
 //
-static const cmd_op_t ops[] PROGMEM = {
-                                       {HEXCMD_RESET_BUS, hex_reset_bus},
-                                       {HEXCMD_NULL, hex_null},
-                                       {HEXCMD_INVALID_MARKER, NULL}
+static const cmd_proc ops[] PROGMEM = {
+                                       hex_null,          // HEXCMD_NULL
+                                       hex_reset_bus      // HEXCMD_RESET_BUS
                                       };
 
 
 static inline void bus_init(void) {
-  reg_add(DEV_ALL, DEV_ALL, DEV_ALL, ops);
+  reg_add(DEV_ALL, DEV_ALL, DEV_ALL, ops, REG_OPS_LEN(ops));
 }
 
 
@@ -159,6 +140,25 @@ void setup(void) {
 }
 
 
+#ifdef CONFIG_IDLE_TASKS
+/*
+  idle_tasks() -
+  run one piece of deferred work while the bus is quiet.  A transaction
+  that starts meanwhile is held at its first HSK until we are done.
+  Returns the drv_idle() result, IDLE_DONE if the bus got busy.
+*/
+static uint8_t idle_tasks(void) {
+  uint8_t busy = IDLE_DONE;
+
+  hex_idle_start();
+  if (hex_is_bav())
+    busy = drv_idle();
+  hex_idle_end();
+  return busy;
+}
+#endif
+
+
 int main(void) __attribute__((OS_main));
 //int  __attribute__ ((noreturn)) main(void);
 int main(void) {
@@ -172,6 +172,9 @@ int main(void) {
 #ifdef HAVE_HOTPLUG
   uint8_t disk_state_old = 0;
 #endif
+#ifdef CONFIG_IDLE_TASKS
+  uint8_t idle;
+#endif
 
   setup();
 
@@ -191,6 +194,13 @@ int main(void) {
     set_busy_led( FALSE );
 
     while (hex_is_bav()) {
+#ifdef CONFIG_IDLE_TASKS
+      idle = idle_tasks();
+      if (idle == IDLE_WAIT)
+        pwr_sleep(SLEEP_TICK);  // the timer tick or BAV wakes us
+      if (idle != IDLE_DONE)
+        continue;
+#endif
       // sleep until BAV falls. If low, HSK will be low.(if power management enabled, if not this is nop)
       if(rtc_type != RTC_TYPE_SW) {  // can't sleep if RTC is SW
         if(ser_is_open() || prn_is_open()) { // snooze
@@ -244,7 +254,14 @@ int main(void) {
 
 
         if ( res == HEXERR_SUCCESS ) {
-          i++;
+          if ( i == 0 && reg_find( pabdata.pab.dev ) == NULL ) {
+            // dev is the first byte. If it is not one of ours, stop
+            // handshaking now and let the rest of the PAB pass us by.
+            ignore_cmd = TRUE;
+            i = 9;
+          } else {
+            i++;
+          }
         } else {
           ignore_cmd = TRUE;
           i = 9;
@@ -252,16 +269,6 @@ int main(void) {
         }
       }
 
-      if ( !ignore_cmd ) {
-        ignore_cmd = TRUE;
-        for (uint8_t j = 0; j < registry.num_devices; j++) {
-          if(registry.entry[j].dev_cur == pabdata.pab.dev) {
-            // we should cache the index...
-            ignore_cmd = FALSE;
-            break;
-          }
-        }
-      }
       if ( !ignore_cmd ) {
         if (i == 9) {
           // exec command
@@ -269,7 +276,9 @@ int main(void) {
           if ( pabdata.pab.dev == 0 && pabdata.pab.cmd != HEXCMD_RESET_BUS ) {
             pabdata.pab.cmd = HEXCMD_NULL; // change out to NULL operation and let bus float.
           }
+          trace_start( pabdata.raw );
           execute_command( &(pabdata.pab) );
+          trace_end();
           ignore_cmd = TRUE;  // in case someone sends more data, ignore it.
         }
       } else {
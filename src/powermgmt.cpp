@@ -40,6 +40,10 @@ POWER_MGMT_HANDLER {
 // Power use reduction
 void pwr_sleep( sleep_mode_t mode ) {
   switch (mode) {
+    case SLEEP_TICK:
+      // keep the timers running, so the next tick wakes us as well
+      set_sleep_mode( SLEEP_MODE_IDLE );
+      break;
     case SLEEP_IDLE:
       power_spi_disable();
       power_timer0_disable();
@@ -63,6 +67,11 @@ void pwr_sleep( sleep_mode_t mode ) {
   led_sleep();            // make sure LED is not lit when we sleep.
   sleep_cpu();
 
+  if (mode == SLEEP_TICK) {
+    // woken by the tick, BAV did not run the handler
+    sleep_disable();
+    pwr_irq_disable();
+  }
   return;
 }
 
@@ -27,6 +27,7 @@ extern "C"{
 #ifdef INCLUDE_POWERMGMT
 
 typedef enum {
+  SLEEP_TICK,
   SLEEP_IDLE,
   SLEEP_STANDBY,
   SLEEP_PWR_DOWN
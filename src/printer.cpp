@@ -232,7 +232,7 @@ static void prn_read(pab_t *pab) {
   debug_puts_P("Read Printer Status\r\n");
 
   if(pab->lun == LUN_CMD) {
-    hex_read_status();
+    hex_read_status(pab);
   } else {
     // TODO I don't think this is needed here.  
   	//if ( !hex_is_bav() ) {
@@ -248,6 +248,16 @@ static void prn_read(pab_t *pab) {
     prn_write() -
     write data to serial port when printer is open.
 */
+#ifdef CONFIG_HEXBUS_IRQ
+static void prn_sink(uint8_t *data, uint8_t len) {
+  for(uint8_t j = 0; j < len; j++) {
+    swuart_putc(0, data[j]);
+  }
+  // the host keeps sending into the other half while this drains
+  swuart_flush();
+}
+#endif
+
 static void prn_write(pab_t *pab) {
   uint16_t len;
   uint16_t i;
@@ -265,6 +275,15 @@ static void prn_write(pab_t *pab) {
   }
 
   if(_prn_open) {
+#ifdef CONFIG_HEXBUS_IRQ
+    if(len) {
+      rc = hex_get_stream(len, prn_sink);
+      if(rc == HEXSTAT_SUCCESS) {
+        written = 1;
+        len = 0;
+      }
+    }
+#endif
     while ( len && rc == HEXSTAT_SUCCESS ) {
       i = (len >= BUFSIZE ? BUFSIZE : len);
       rc = hex_get_data(buffer, i);
@@ -341,13 +360,14 @@ void prn_reset( void ) {
 /*
  * Command handling registry for device
  */
-static const cmd_op_t ops[] PROGMEM = {
-                                        {HEXCMD_OPEN,            prn_open},
-                                        {HEXCMD_CLOSE,           prn_close},
-                                        {HEXCMD_WRITE,           prn_write},
-                                        {HEXCMD_READ,            prn_read},
-                                        {HEXCMD_RESET_BUS,       prn_reset_dev},
-                                        {HEXCMD_INVALID_MARKER,  NULL}
+static const cmd_proc ops[] PROGMEM = {
+                                        NULL,          // HEXCMD_NULL
+                                        prn_reset_dev, // HEXCMD_RESET_BUS
+                                        prn_open,      // HEXCMD_OPEN
+                                        prn_close,     // HEXCMD_CLOSE
+                                        NULL,          // HEXCMD_DELETE_OPEN
+                                        prn_read,      // HEXCMD_READ
+                                        prn_write      // HEXCMD_WRITE
                                       };
 
 static uint8_t is_cfg_valid(void) {
@@ -361,7 +381,7 @@ void prn_register(void) {
   if(is_cfg_valid()) {
     prn_dev = _config.prn_dev;
   }
-  reg_add(DEV_PRN_START, prn_dev, DEV_PRN_END, ops);
+  reg_add(DEV_PRN_START, prn_dev, DEV_PRN_END, ops, REG_OPS_LEN(ops));
 }
 
 
@@ -19,12 +19,52 @@
 */
 
 
+#include <string.h>
 #include "config.h"
 #include "debug.h"
 #include "hexops.h"
 #include "registry.h"
 
-void reg_add(uint8_t low, uint8_t cur, uint8_t high, const cmd_op_t ops[]) {
+#ifdef CONFIG_REG_INDEX
+/*
+   reg_index() -
+   rebuild the device code to registry slot index.  Must be
+   called whenever an entry is added or its dev_cur changes.
+   Earlier entries win if two answer to the same code, as
+   they did with the old linear scan.
+*/
+void reg_index(void) {
+  uint8_t i = registry.num_devices;
+  uint8_t dev;
+
+  memset(registry.index, 0, sizeof(registry.index));
+  while (i) {
+    dev = registry.entry[ i - 1 ].dev_cur;
+    if (dev & 1)
+      registry.index[ dev >> 1 ] = (registry.index[ dev >> 1 ] & 0x0f) | (i << 4);
+    else
+      registry.index[ dev >> 1 ] = (registry.index[ dev >> 1 ] & 0xf0) | i;
+    i--;
+  }
+}
+#else
+/*
+   reg_find() -
+   return the first registry entry currently answering to
+   device code dev, or NULL if there is none.
+*/
+registry_entry_t *reg_find(uint8_t dev) {
+  uint8_t i;
+
+  for (i = 0; i < registry.num_devices; i++) {
+    if (registry.entry[ i ].dev_cur == dev)
+      return &registry.entry[ i ];
+  }
+  return NULL;
+}
+#endif
+
+void reg_add(uint8_t low, uint8_t cur, uint8_t high, const cmd_proc ops[], uint8_t num_ops) {
   uint8_t i;
 
   for (i = 0; i < registry.num_devices; i++) {
@@ -36,7 +76,9 @@ void reg_add(uint8_t low, uint8_t cur, uint8_t high, const cmd_op_t ops[]) {
   registry.entry[ i ].dev_low = low;
   registry.entry[ i ].dev_cur = cur;
   registry.entry[ i ].dev_high = high;
-  registry.entry[ i ].oplist = (cmd_op_t *)ops;
+  registry.entry[ i ].num_ops = num_ops;
+  registry.entry[ i ].ops = ops;
+  reg_index();
 }
 
 
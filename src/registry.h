@@ -6,6 +6,8 @@
 #ifndef REGISTRY_H
 #define REGISTRY_H
 
+#include <stddef.h>
+#include "config.h"
 #include "hexbus.h"
 
 #ifdef NEW_REG_CNT
@@ -34,31 +36,64 @@
 #define MAX_REGISTRY      8
 #endif
 
-typedef void (*cmd_proc)(pab_t *pab);
+#if defined CONFIG_REG_INDEX && MAX_REGISTRY > 15
+#  error "The device index only holds 15 registry slots."
+#endif
 
-// This is used as a marker in our registry to indicate end of operations table.
-// It is NOT a valid HexBus command code.
-#define HEXCMD_INVALID_MARKER     (hexcmdtype_t)0xAA
+typedef void (*cmd_proc)(pab_t *pab);
 
-typedef struct _cmd_op_t {
-  hexcmdtype_t command;
-  void (*operation)(pab_t*);
-} cmd_op_t;
+/*
+ * Device command tables are dense PROGMEM arrays of handlers,
+ * indexed by REG_CMD_SLOT(command).  The two bus wide commands
+ * at the top of the command range wrap around to the front, so
+ * a table starts with:
+ *   slot 0: HEXCMD_NULL
+ *   slot 1: HEXCMD_RESET_BUS
+ *   slot 2: HEXCMD_OPEN, and so on in hexcmdtype_t order.
+ * Tables only need to reach the highest command the device handles,
+ * NULL entries are reported as unsupported.
+ */
+#define REG_CMD_SLOT(cmd)   ((uint8_t)((cmd) - HEXCMD_NULL))
+#define REG_OPS_LEN(ops)    (sizeof(ops) / sizeof(ops[0]))
 
 typedef struct _registry_entry {
   uint8_t dev_low;
   uint8_t dev_cur;
   uint8_t dev_high;
-  cmd_op_t *oplist;
+  uint8_t num_ops;
+  const cmd_proc *ops;
 } registry_entry_t;
 
 typedef struct _registry_t {
   uint8_t num_devices;
   registry_entry_t entry[MAX_REGISTRY];
+#ifdef CONFIG_REG_INDEX
+  uint8_t index[256 / 2];   // device code -> slot + 1, one nibble each, 0 = none
+#endif
 } registry_t;
 
 extern registry_t  registry;
 
-void reg_add(uint8_t low, uint8_t cur, uint8_t high, const cmd_op_t ops[]);
+void reg_add(uint8_t low, uint8_t cur, uint8_t high, const cmd_proc ops[], uint8_t num_ops);
+
+#ifdef CONFIG_REG_INDEX
+void reg_index(void);
+
+/*
+ * reg_find() - return the registry entry currently answering
+ * to device code dev, or NULL if there is none.
+ */
+static inline registry_entry_t *reg_find(uint8_t dev) {
+  uint8_t slot = registry.index[ dev >> 1 ];
+
+  if (dev & 1)
+    slot >>= 4;
+  slot &= 0x0f;
+  return (slot ? &registry.entry[ slot - 1 ] : NULL);
+}
+#else
+#define reg_index() do {} while(0)
+registry_entry_t *reg_find(uint8_t dev);
+#endif
 
 #endif
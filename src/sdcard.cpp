@@ -32,6 +32,7 @@
 
 */
 
+#include <avr/pgmspace.h>
 #include "config.h"
 #include "crc.h"
 #include "debug.h"
@@ -184,6 +185,36 @@ SD2_CHANGE_HANDLER {
 }
 #endif
 
+#ifdef CONFIG_SD_STATS
+diskstats_t disk_stats;
+
+/* add the time since start to the log2 histogram of op */
+static void stat_add(uint8_t op, uint16_t start) {
+  uint16_t t = gettimer() - start;
+  uint8_t  b = 0;
+
+  while (t > 1 && b < DISK_STAT_BUCKETS - 1) {
+    t >>= 1;
+    b++;
+  }
+  disk_stats.hist[op][b]++;
+}
+
+#  define stat_start(v)    v = gettimer()
+#  define stat_count(x)    disk_stats.x++
+#else
+#  define stat_start(v)    do {} while(0)
+#  define stat_add(op,v)   do {} while(0)
+#  define stat_count(x)    do {} while(0)
+#endif
+
+/* flag a failed card access, counting the change to DISK_ERROR */
+static void card_error(void) {
+  if (disk_state != DISK_ERROR)
+    stat_count(errors);
+  disk_state = DISK_ERROR;
+}
+
 /* wait for a certain byte from the card */
 /* (with 500ms timeout) */
 static uint8_t expect_byte(uint8_t value) {
@@ -194,9 +225,14 @@ static uint8_t expect_byte(uint8_t value) {
     b = spi_rx_byte();
   } while (b != value && time_before(getticks(), timeout));
 
+  if (b != value)
+    stat_count(timeouts);
   return b == value;
 }
 
+/* card still programming the last write, plus one (0 if none) */
+static uint8_t write_busy;
+
 /* deselect card(s) and send 24 clocks */
 /* (was 8, but some cards prefer more) */
 static void deselect_card(void) {
@@ -207,6 +243,28 @@ static void deselect_card(void) {
   spi_rx_byte();
 }
 
+/* wait until the card has programmed the last write */
+/* (with 500ms timeout) */
+static uint8_t wait_write(void) {
+  uint8_t ok;
+#ifdef CONFIG_SD_STATS
+  uint16_t start;
+#endif
+
+  if (!write_busy)
+    return TRUE;
+  stat_start(start);
+  spi_select_device((spi_device_t)write_busy);
+  ok = expect_byte(0xff);
+  write_busy = 0;
+  deselect_card();
+  if (!ok)
+    card_error();
+  else
+    stat_add(DISK_STAT_BUSY, start);
+  return ok;
+}
+
 /* check if card in @drv is write protected */
 static uint8_t sd_wrprot(uint8_t drv __attribute__((unused))) {
 #ifdef CONFIG_TWINSD
@@ -249,6 +307,10 @@ static uint8_t send_command(const uint8_t  card,
   crc = crc7update(crc, convert.val8[0]);
   crc = (crc << 1) | 1;
 
+  /* a card busy with a write does not take commands */
+  if (!wait_write())
+    return 0xff;
+
   errors = 0;
   while (errors < CONFIG_SD_AUTO_RETRIES) {
     /* select card */
@@ -257,7 +319,7 @@ static uint8_t send_command(const uint8_t  card,
 
     /* send command */
     spi_tx_byte(cmd);
-    tmp = swap_word(parameter); // AVR spi_tx_block clobbers the buffer
+    tmp = swap_word(parameter); // the card expects the parameter MSB first
     spi_tx_block(&tmp, 4);
     spi_tx_byte(crc);
 
@@ -267,10 +329,13 @@ static uint8_t send_command(const uint8_t  card,
       res = spi_rx_byte();
     } while ((res & 0x80) &&
              time_before(getticks(), timeout));
+    if (res & 0x80)
+      stat_count(timeouts);
 
     /* check for CRC error */
     if (res & STATUS_CRC_ERROR) {
       debug_putc('x');
+      stat_count(crc_errors);
       deselect_card();
       errors++;
       continue;
@@ -282,6 +347,118 @@ static uint8_t send_command(const uint8_t  card,
   return res;
 }
 
+/* end a multi-block transfer with STOP_TRANSMISSION */
+/* (the card stays selected) */
+/* Not sent with send_command: until the command takes effect the card */
+/* keeps sending data, which must neither be taken for the response */
+/* nor trigger a CRC retry. */
+static void stop_transmission(uint8_t drv __attribute__((unused))) {
+  tick_t  timeout;
+  uint8_t i, crc, res;
+
+  crc = crc7update(0, STOP_TRANSMISSION);
+  for (i = 0; i < 4; i++)
+    crc = crc7update(crc, 0);
+
+  spi_tx_byte(STOP_TRANSMISSION);
+  for (i = 0; i < 4; i++)
+    spi_tx_byte(0);
+  spi_tx_byte((crc << 1) | 1);
+
+  /* skip the stuff byte, then wait for R1 */
+  spi_rx_byte();
+  timeout = getticks() + HZ/2;
+  do {
+    res = spi_rx_byte();
+  } while ((res & 0x80) && time_before(getticks(), timeout));
+  if (res & 0x80) {
+    stat_count(timeouts);
+    return;
+  }
+
+  /* R1b: wait while the card is busy */
+  expect_byte(0xff);
+}
+
+/* read the CSD register of the card into buf (18 bytes) */
+static uint8_t read_csd(uint8_t drv, uint8_t *buf) {
+  if (send_command(drv, SEND_CSD, 0) != 0 || !expect_byte(0xfe)) {
+    deselect_card();
+    return FALSE;
+  }
+  spi_rx_block(buf, 18);
+  deselect_card();
+  return TRUE;
+}
+
+/* TRAN_SPEED time value, times ten */
+static const PROGMEM uint8_t tran_speed_mult[16] = {
+  0, 10, 12, 13, 15, 20, 25, 30, 35, 40, 45, 50, 55, 60, 70, 80
+};
+
+/* fast SPI divisor allowed by each card, 0 if not initialized */
+static uint8_t card_divisor[MAX_CARDS];
+
+/* run the bus at the fastest clock all initialized cards allow */
+static void set_fast_divisor(void) {
+  uint8_t i, div = 0;
+
+  for (i = 0; i < MAX_CARDS; i++)
+    if (card_divisor[i] > div)
+      div = card_divisor[i];
+  spi_set_fast_divisor(div);
+  spi_set_speed(SPI_SPEED_FAST);
+}
+
+/* SPI divisor for the TRAN_SPEED field of the CSD */
+static uint8_t csd_divisor(uint8_t tran_speed) {
+  uint16_t unit;
+  uint32_t max;
+  uint8_t  div;
+
+  /* transfer rate unit in 100kbit/s, only 100k to 100M are defined */
+  if ((tran_speed & 7) > 3)
+    return SPI_DIVISOR_FAST;
+  unit = 1;
+  for (div = tran_speed & 7; div; div--)
+    unit *= 10;
+  max = (uint32_t)unit * pgm_read_byte(&tran_speed_mult[(tran_speed >> 3) & 15]) / 10;
+  if (!max)
+    return SPI_DIVISOR_FAST;
+
+  for (div = 2; div < 128 && F_CPU / 100000 / div > max; div *= 2)
+    ;
+  return div;
+}
+
+#ifdef CONFIG_SD_HIGHSPEED
+/* switch an SD card to high speed mode with SWITCH_FUNC if it has it */
+static void switch_highspeed(uint8_t drv) {
+  uint8_t i, b, support = 0;
+
+  /* check function group 1 for high speed support (bit 401) */
+  if (send_command(drv, SWITCH_FUNC, 0x00fffff1) != 0 || !expect_byte(0xfe)) {
+    deselect_card();
+    return;
+  }
+  for (i = 0; i < 64 + 2; i++) {
+    b = spi_rx_byte();
+    if (i == 13)
+      support = b;
+  }
+  deselect_card();
+  if (!(support & 0x02))
+    return;
+
+  /* switch, the CSD shows the new speed afterwards */
+  if (send_command(drv, SWITCH_FUNC, 0x80fffff1) == 0 && expect_byte(0xfe)) {
+    for (i = 0; i < 64 + 2; i++)
+      spi_rx_byte();
+  }
+  deselect_card();
+}
+#endif
+
 /* ------------------------------------------------------------------------- */
 /*  external SD functions                                                    */
 /* ------------------------------------------------------------------------- */
@@ -340,6 +517,13 @@ DSTATUS sd_initialize(BYTE drv) {
   uint32_t parameter;
   uint16_t tries = 3;
   uint8_t  i,res;
+  uint8_t  csd[18];
+#ifdef CONFIG_SD_HIGHSPEED
+  uint8_t  is_sd = FALSE;
+#endif
+#ifdef CONFIG_SD_STATS
+  uint16_t start;
+#endif
   tick_t   timeout;
 
   if (drv >= MAX_CARDS)
@@ -350,10 +534,12 @@ DSTATUS sd_initialize(BYTE drv) {
     return sd_status(drv);
 
   spi_init(SPI_SPEED_SLOW);
+  stat_start(start);
 
  retry:
   disk_state = DISK_ERROR;
   cardtype[drv] = CARD_MMCSD;
+  card_divisor[drv] = 0;
 
   /* send 80 clocks with SS high */
   spi_select_device(SPIDEV_NONE);
@@ -443,8 +629,14 @@ DSTATUS sd_initialize(BYTE drv) {
 
   deselect_card();
 
+  /* the SD card is ready, SEND_OP_COND is for MMC cards only */
+#ifdef CONFIG_SD_HIGHSPEED
+  is_sd = TRUE;
+#endif
+  goto ready;
+
  not_sd:
-  /* tell MMC cards to initialize (SD ignores this) */
+  /* tell MMC cards to initialize */
   timeout = getticks() + HZ/2;
   do {
     res = send_command(drv, SEND_OP_COND, 1L<<30);
@@ -454,6 +646,11 @@ DSTATUS sd_initialize(BYTE drv) {
   if (res != 0)
     return STA_NOINIT;
 
+ ready:
+  /* identification is done, the rest can run at full speed */
+  card_divisor[drv] = SPI_DIVISOR_FAST;
+  set_fast_divisor();
+
   /* enable CRC checks */
   res = send_command(drv, CRC_ON_OFF, 1);
   deselect_card();
@@ -466,8 +663,19 @@ DSTATUS sd_initialize(BYTE drv) {
   if (res != 0)
     return STA_NOINIT;
 
-  spi_set_speed(SPI_SPEED_FAST);
+#ifdef CONFIG_SD_HIGHSPEED
+  if (is_sd)
+    switch_highspeed(drv);
+#endif
+
+  /* run the card as fast as its CSD says it can go */
+  /* (with two cards, as fast as the slower one can go) */
+  if (read_csd(drv, csd)) {
+    card_divisor[drv] = csd_divisor(getbits(csd, 127-103, 8));
+    set_fast_divisor();
+  }
   disk_state = DISK_OK;
+  stat_add(DISK_STAT_INIT, start);
 
   return sd_status(drv);
 }
@@ -486,10 +694,15 @@ DSTATUS disk_initialize(BYTE drv) __attribute__ ((weak, alias("sd_initialize")))
  * the calculated data CRC does not match the one sent by the
  * card. If there were errors during the command transmission
  * disk_state will be set to DISK_ERROR and no retries are made.
+ * More than one sector is read with a single READ_MULTIPLE_BLOCK,
+ * which is restarted at the failing sector for a retry.
  */
 DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
-  uint8_t  res, sec, errors;
+  uint8_t  res, sec, errors, multi;
   uint16_t crc, recvcrc;
+#ifdef CONFIG_SD_STATS
+  uint16_t start;
+#endif
 
   if (drv >= MAX_CARDS)
     return RES_PARERR;
@@ -498,81 +711,77 @@ DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) {
   if (cardtype[drv] == CARD_MMCSD)
     sector <<= 9;
 
+  multi = FALSE;
   for (sec = 0; sec < count; sec++) {
+    stat_start(start);
     errors = 0;
     while (errors < CONFIG_SD_AUTO_RETRIES) {
-      /* send read command */
-      if (cardtype[drv] & CARD_SDHC)
-        res = send_command(drv, READ_SINGLE_BLOCK, sector + sec);
-      else
-        res = send_command(drv, READ_SINGLE_BLOCK, sector + (sec << 9));
-
-      /* fail if the command wasn't accepted */
-      if (res != 0) {
-        deselect_card();
-        disk_state = DISK_ERROR;
-        return RES_ERROR;
+      if (!multi) {
+        /* send read command, for all remaining sectors if there are more */
+        multi = (count - sec > 1);
+        res = send_command(drv, (multi ? READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK),
+                           sector + ((cardtype[drv] & CARD_SDHC) ? sec : (DWORD)sec << 9));
+
+        /* fail if the command wasn't accepted */
+        if (res != 0) {
+          deselect_card();
+          card_error();
+          return RES_ERROR;
+        }
       }
 
       /* wait for start block token */
       if (!expect_byte(0xfe)) {
+        if (multi)
+          stop_transmission(drv);
         deselect_card();
-        disk_state = DISK_ERROR;
+        card_error();
         return RES_ERROR;
       }
 
       /* transfer data */
-      crc = 0;
 #ifdef CONFIG_SD_BLOCKTRANSFER
       /* transfer data first, calculate CRC afterwards */
       spi_rx_block(buffer, 512);
-
-      recvcrc = spi_rx_byte() << 8 | spi_rx_byte();
       crc = crc_xmodem_block(0, buffer, 512);
 #else
-      /* interleave transfer/CRC calculation, AVR-optimized */
-      uint16_t i;
-      uint8_t  tmp;
-      BYTE     *ptr = buffer;
-
-      /* start SPI data exchange */
-      SPDR = 0xff;
-
-      for (i=0; i<512; i++) {
-        /* wait until byte available */
-        loop_until_bit_is_set(SPSR, SPIF);
-        tmp = SPDR;
-        /* transmit the next byte while the current one is processed */
-        SPDR = 0xff;
-
-        *ptr++ = tmp;
-        crc = crc_xmodem_update(crc, tmp);
-      }
-      /* wait for the first CRC byte */
-      loop_until_bit_is_set(SPSR, SPIF);
-
-      recvcrc  = SPDR << 8;
-      recvcrc |= spi_rx_byte();
+      /* calculate CRC while the SPI unit shifts */
+      crc = spi_rx_block_crc(buffer, 512);
 #endif
+      recvcrc = spi_rx_byte() << 8;
+      recvcrc |= spi_rx_byte();
 
-      /* check CRC */
+      /* check CRC, retry from this sector on */
       if (recvcrc != crc) {
         debug_putc('X');
+        stat_count(crc_errors);
+        if (multi)
+          stop_transmission(drv);
         deselect_card();
+        multi = FALSE;
         errors++;
         continue;
       }
 
       break; // FIXME: Ugly control flow
     }
-    deselect_card();
 
     if (errors >= CONFIG_SD_AUTO_RETRIES)
       return RES_ERROR;
 
+    /* a multi-block read goes on with the next sector */
+    if (!multi)
+      deselect_card();
+    stat_add(DISK_STAT_READ, start);
+
     buffer += 512;
   }
 
+  if (multi) {
+    stop_transmission(drv);
+    deselect_card();
+  }
+
   return RES_OK;
 }
 DRESULT disk_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) __attribute__ ((weak, alias("sd_read")));
@@ -590,11 +799,19 @@ DRESULT disk_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count) __attribute_
  * if successful. Up to SD_AUTO_RETRIES will be made if the card
  * signals a CRC error. If there were errors during the command
  * transmission disk_state will be set to DISK_ERROR and no retries
- * are made.
+ * are made. More than one sector is written with a single
+ * WRITE_MULTIPLE_BLOCK, after telling the card how many blocks to
+ * pre-erase. A retry restarts it at the failing sector.
+ * The function returns while the card is still programming the
+ * data, see sd_sync.
  */
 DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
-  uint8_t  res, sec, errors;
+  uint8_t  res, sec, errors, multi;
   uint16_t crc;
+  DWORD    addr;
+#ifdef CONFIG_SD_STATS
+  uint16_t start;
+#endif
 
   if (drv >= MAX_CARDS)
     return RES_PARERR;
@@ -607,41 +824,46 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
   if (cardtype[drv] == CARD_MMCSD)
     sector <<= 9;
 
+  multi = FALSE;
   for (sec = 0; sec < count; sec++) {
     errors = 0;
     while (errors < CONFIG_SD_AUTO_RETRIES) {
-      /* send write command */
-      if (cardtype[drv] & CARD_SDHC)
-        res = send_command(drv, WRITE_BLOCK, sector + sec);
-      else
-        res = send_command(drv, WRITE_BLOCK, sector + (sec << 9));
-
-      /* fail if the command wasn't accepted */
-      if (res != 0) {
-        deselect_card();
-        disk_state = DISK_ERROR;
-        return RES_ERROR;
+      stat_start(start);
+      if (!multi) {
+        /* send write command, for all remaining sectors if there are more */
+        multi = (count - sec > 1);
+        addr = sector + ((cardtype[drv] & CARD_SDHC) ? sec : (DWORD)sec << 9);
+        if (multi) {
+          /* let the card erase the blocks ahead, MMC cards ignore this */
+          res = send_command(drv, APP_CMD, 0);
+          deselect_card();
+          if (res <= 1) {
+            send_command(drv, SD_SET_WR_BLK_ERASE_COUNT, count - sec);
+            deselect_card();
+          }
+          res = send_command(drv, WRITE_MULTIPLE_BLOCK, addr);
+        } else {
+          res = send_command(drv, WRITE_BLOCK, addr);
+        }
+
+        /* fail if the command wasn't accepted */
+        if (res != 0) {
+          deselect_card();
+          card_error();
+          return RES_ERROR;
+        }
       }
 
       /* send data token */
-      spi_tx_byte(0xfe);
+      spi_tx_byte(multi ? 0xfc : 0xfe);
 
       /* transfer data */
 #ifdef CONFIG_SD_BLOCKTRANSFER
       spi_tx_block(buffer, 512);
       crc = crc_xmodem_block(0, buffer, 512);
 #else
-      /* interleave transfer/CRC calculations, AVR-optimized */
-      uint16_t i;
-      const BYTE *ptr = buffer;
-
-      crc = 0;
-      spi_select_device((spi_device_t)(drv+1));
-      for (i=0; i<512; i++) {
-        SPDR = *ptr;
-        crc = crc_xmodem_update(crc, *ptr++);
-        loop_until_bit_is_set(SPSR, SPIF);
-      }
+      /* calculate CRC while the SPI unit shifts */
+      crc = spi_tx_block_crc(buffer, 512);
 #endif
 
       /* send CRC */
@@ -651,35 +873,227 @@ DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) {
       /* read status byte */
       res = spi_rx_byte();
 
-      /* retry on error */
+      /* retry on error, from this sector on */
       if ((res & 0x0f) != 0x05) {
         debug_putc('X');
+        stat_count(crc_errors);
+        if (multi) {
+          /* a multi-block write is ended with STOP_TRANSMISSION after an error */
+          expect_byte(0xff);
+          stop_transmission(drv);
+        }
         deselect_card();
+        multi = FALSE;
         errors++;
         continue;
       }
 
-      /* wait until write is finished */
-      // FIXME: Timeout?
-      do {
-        res = spi_rx_byte();
-      } while (res == 0);
+      stat_add(DISK_STAT_WRITE, start);
+      if (multi) {
+        /* the next block can only be sent once this one is written */
+        stat_start(start);
+        if (!expect_byte(0xff)) {
+          deselect_card();
+          card_error();
+          return RES_ERROR;
+        }
+        stat_add(DISK_STAT_BUSY, start);
+      } else {
+        /* the next command waits until the write is finished */
+        write_busy = drv + 1;
+      }
 
       break; // FIXME: Ugly control flow
     }
-    deselect_card();
 
     if (errors >= CONFIG_SD_AUTO_RETRIES) {
       return RES_ERROR;
     }
 
+    /* a multi-block write goes on with the next sector */
+    if (!multi)
+      deselect_card();
+
     buffer += 512;
   }
 
+  if (multi) {
+    /* send stop token, the card is busy after the next byte */
+    spi_tx_byte(0xfd);
+    spi_rx_byte();
+    write_busy = drv + 1;
+    deselect_card();
+  }
+
   return RES_OK;
 }
 DRESULT disk_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) __attribute__ ((weak, alias("sd_write")));
 
+/**
+ * sd_sync - wait for the last write to finish
+ * @drv   : drive
+ *
+ * Writes return as soon as the card has accepted the data. The card
+ * is left to program it while the caller goes on, and the next command
+ * waits for it. This function waits right away instead, so it can be
+ * done while nothing else is going on. Returns RES_ERROR if the card
+ * did not finish in time.
+ */
+DRESULT sd_sync(BYTE drv __attribute__((unused))) {
+  return (wait_write() ? RES_OK : RES_ERROR);
+}
+DRESULT disk_sync(BYTE drv) __attribute__ ((weak, alias("sd_sync")));
+
+#ifdef CONFIG_SD_STREAMING
+/* ------------------------------------------------------------------------- */
+/*  Streamed single-sector transfers                                         */
+/* ------------------------------------------------------------------------- */
+
+/* State of the streamed transfer in progress */
+static uint16_t stream_crc;
+static uint16_t stream_left;
+static uint8_t  stream_write;
+static uint8_t  stream_drv;
+
+/**
+ * sd_stream_open - start a streamed transfer of a single sector
+ * @drv   : drive
+ * @sector: sector to be transferred
+ * @write : TRUE to write the sector, FALSE to read it
+ *
+ * This function issues the read or write command for sector and
+ * leaves the card selected, so the data can be moved one byte at
+ * a time with sd_stream_get/sd_stream_put while the caller does
+ * other work, e.g. waiting out the HEX-BUS handshake windows.
+ * The transfer must be ended with sd_stream_close. Returns RES_OK
+ * if the card is ready to move data, an error code otherwise.
+ */
+DRESULT sd_stream_open(BYTE drv, DWORD sector, BYTE write) {
+  uint8_t res;
+
+  if (drv >= MAX_CARDS)
+    return RES_PARERR;
+
+  if (write && sd_wrprot(drv))
+    return RES_WRPRT;
+
+  /* convert sector number to byte offset for non-SDHC cards */
+  if (cardtype[drv] == CARD_MMCSD)
+    sector <<= 9;
+
+  res = send_command(drv, (write ? WRITE_BLOCK : READ_SINGLE_BLOCK), sector);
+  if (res != 0 || (!write && !expect_byte(0xfe))) {
+    deselect_card();
+    card_error();
+    return RES_ERROR;
+  }
+
+  stream_crc = 0;
+  stream_left = 512;
+  stream_write = write;
+  stream_drv = drv;
+  if (write) {
+    /* send data token, the first data byte follows in sd_stream_put */
+    spi_tx_byte(0xfe);
+  } else {
+    /* start clocking in the first data byte */
+    SPDR = 0xff;
+  }
+  return RES_OK;
+}
+DRESULT disk_stream_open(BYTE drv, DWORD sector, BYTE write) __attribute__ ((weak, alias("sd_stream_open")));
+
+/**
+ * sd_stream_get - return the next byte of a streamed read
+ *
+ * This function returns the byte clocked in since the last call
+ * and immediately starts the SPI exchange for the next one, so
+ * the transfer runs in hardware until the byte is needed.
+ */
+BYTE sd_stream_get(void) {
+  uint8_t tmp;
+
+  loop_until_bit_is_set(SPSR, SPIF);
+  tmp = SPDR;
+  SPDR = 0xff;
+  stream_crc = crc_xmodem_update(stream_crc, tmp);
+  stream_left--;
+  return tmp;
+}
+BYTE disk_stream_get(void) __attribute__ ((weak, alias("sd_stream_get")));
+
+/**
+ * sd_stream_put - send the next byte of a streamed write
+ * @data: byte to be written
+ *
+ * This function waits for the previous byte to leave the SPI
+ * shift register, then starts sending data without waiting.
+ */
+void sd_stream_put(BYTE data) {
+  if (stream_left != 512)
+    loop_until_bit_is_set(SPSR, SPIF);
+  SPDR = data;
+  stream_crc = crc_xmodem_update(stream_crc, data);
+  stream_left--;
+}
+void disk_stream_put(BYTE data) __attribute__ ((weak, alias("sd_stream_put")));
+
+/**
+ * sd_stream_close - finish a streamed transfer
+ *
+ * This function completes the transfer started by sd_stream_open
+ * and checks its result. A read that was not fully consumed is
+ * drained, a write that was not fully supplied is padded and sent
+ * with an invalid CRC so the card discards it. Returns RES_OK if
+ * the whole sector was transferred successfully, RES_ERROR otherwise.
+ */
+DRESULT sd_stream_close(void) {
+  uint8_t  res;
+  uint16_t crc;
+  DRESULT  rc = RES_OK;
+
+  if (stream_write) {
+    if (stream_left) {
+      while (stream_left)
+        sd_stream_put(0xff);
+      stream_crc = ~stream_crc;
+      rc = RES_ERROR;
+    }
+    /* wait for the last data byte */
+    loop_until_bit_is_set(SPSR, SPIF);
+    crc = stream_crc;
+    spi_tx_byte(crc >> 8);
+    spi_tx_byte(crc & 0xff);
+
+    /* read status byte */
+    res = spi_rx_byte();
+    if ((res & 0x0f) != 0x05) {
+      debug_putc('X');
+      stat_count(crc_errors);
+      rc = RES_ERROR;
+    } else {
+      /* the next command waits until the write is finished */
+      write_busy = stream_drv + 1;
+    }
+  } else {
+    while (stream_left)
+      sd_stream_get();
+    /* wait for the first CRC byte */
+    loop_until_bit_is_set(SPSR, SPIF);
+    crc  = SPDR << 8;
+    crc |= spi_rx_byte();
+    if (crc != stream_crc) {
+      debug_putc('X');
+      stat_count(crc_errors);
+      rc = RES_ERROR;
+    }
+  }
+  deselect_card();
+  return rc;
+}
+DRESULT disk_stream_close(void) __attribute__ ((weak, alias("sd_stream_close")));
+#endif
+
 /**
  * sd_getinfo - read card information
  * @drv   : drive
@@ -693,7 +1107,6 @@ DRESULT disk_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count) __att
  */
 DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
   uint8_t buf[18];
-  uint8_t res;
   uint32_t capacity;
 
   if (drv >= MAX_CARDS)
@@ -706,19 +1119,8 @@ DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer) {
     return RES_ERROR;
 
   /* Try to calculate the total number of sectors on the card */
-  if (send_command(drv, SEND_CSD, 0) != 0) {
-    deselect_card();
+  if (!read_csd(drv, buf))
     return RES_ERROR;
-  }
-
-  /* Wait for data token */
-  // FIXME: Timeout?
-  do {
-    res = spi_rx_byte();
-  } while (res == 0);
-
-  spi_rx_block(buf, 18);
-  deselect_card();
 
   if (cardtype[drv] & CARD_SDHC) {
     /* Special CSD for SDHC cards */
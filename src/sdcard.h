@@ -43,6 +43,12 @@ DSTATUS sd_initialize(BYTE drv);
 DRESULT sd_read(BYTE drv, BYTE *buffer, DWORD sector, BYTE count);
 DRESULT sd_write(BYTE drv, const BYTE *buffer, DWORD sector, BYTE count);
 DRESULT sd_getinfo(BYTE drv, BYTE page, void *buffer);
+#ifdef CONFIG_SD_STREAMING
+DRESULT sd_stream_open(BYTE drv, DWORD sector, BYTE write);
+BYTE    sd_stream_get(void);
+void    sd_stream_put(BYTE data);
+DRESULT sd_stream_close(void);
+#endif
 
 #ifdef __cplusplus
 } // extern "C"
@@ -404,13 +404,14 @@ static void ser_close(pab_t *pab) {
 
 static void ser_read(pab_t *pab) {
   uint16_t len = pab->buflen;
+  uint16_t i;
   uint16_t bcount = 0;
   hexstatus_t  rc = HEXSTAT_SUCCESS;
 
   debug_puts_P("Read Serial\r\n");
 
   if(pab->lun == LUN_CMD) {
-    hex_read_status();
+    hex_read_status(pab);
     return;
   }
 
@@ -441,9 +442,10 @@ static void ser_read(pab_t *pab) {
         len = ( len > BUFSIZE ) ? BUFSIZE : len;
 
         bcount -= len;
-        while ( len-- && rc == HEXSTAT_SUCCESS ) {
-          rc = (hex_send_byte( uart_getc() ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
+        for ( i = 0; i < len; i++ ) {
+          buffer[ i ] = uart_getc();
         }
+        rc = (hex_send_block( buffer, len ) == HEXERR_SUCCESS ? HEXSTAT_SUCCESS : HEXSTAT_DATA_ERR);
       }
       if ( rc == HEXSTAT_SUCCESS ) {
         hex_send_byte( rc );
@@ -460,6 +462,14 @@ static void ser_read(pab_t *pab) {
 }
 
 
+#ifdef CONFIG_HEXBUS_IRQ
+static void ser_sink(uint8_t *data, uint8_t len) {
+  for(uint8_t j = 0; j < len; j++) {
+    uart_putc(data[j]);
+  }
+}
+#endif
+
 static void ser_write(pab_t *pab) {
   uint16_t len;
   uint16_t i;
@@ -478,6 +488,13 @@ static void ser_write(pab_t *pab) {
   }
 
   if ( _ser_open & OPENMODE_WRITE ) {
+#ifdef CONFIG_HEXBUS_IRQ
+    if (len) {
+      rc = hex_get_stream(len, ser_sink);
+      if (rc == HEXSTAT_SUCCESS)
+        len = 0;
+    }
+#endif
     while (len && rc == HEXSTAT_SUCCESS ) {
       i = (len >= BUFSIZE ? BUFSIZE : len);
       rc = hex_get_data(buffer, i);
@@ -538,15 +555,25 @@ void ser_reset(void) {
    Command handling registry for device
 */
 
-static const cmd_op_t ops[] PROGMEM = {
-                                        {HEXCMD_OPEN,            ser_open},
-                                        {HEXCMD_CLOSE,           ser_close},
-                                        {HEXCMD_READ,            ser_read},
-                                        {HEXCMD_WRITE,           ser_write},
-                                        {HEXCMD_RETURN_STATUS,   ser_rtn_sta},
-                                        {HEXCMD_SET_OPTIONS,     ser_set_opts},
-                                        {HEXCMD_RESET_BUS,       ser_reset_dev},
-                                        {(hexcmdtype_t)HEXCMD_INVALID_MARKER,  NULL}
+static const cmd_proc ops[] PROGMEM = {
+                                        NULL,          // HEXCMD_NULL
+                                        ser_reset_dev, // HEXCMD_RESET_BUS
+                                        ser_open,      // HEXCMD_OPEN
+                                        ser_close,     // HEXCMD_CLOSE
+                                        NULL,          // HEXCMD_DELETE_OPEN
+                                        ser_read,      // HEXCMD_READ
+                                        ser_write,     // HEXCMD_WRITE
+                                        NULL,          // HEXCMD_RESTORE
+                                        NULL,          // HEXCMD_DELETE
+                                        ser_rtn_sta,   // HEXCMD_RETURN_STATUS
+                                        NULL,          // HEXCMD_SVC_REQ_ENABLE
+                                        NULL,          // HEXCMD_SVC_REQ_DISABLE
+                                        NULL,          // HEXCMD_SVC_REQ_POLL
+                                        NULL,          // HEXCMD_MASTER
+                                        NULL,          // HEXCMD_VERIFY
+                                        NULL,          // HEXCMD_FORMAT
+                                        NULL,          // HEXCMD_CATALOG
+                                        ser_set_opts   // HEXCMD_SET_OPTIONS
                                       };
 
 static uint8_t is_cfg_valid(void) {
@@ -560,7 +587,7 @@ void ser_register(void) {
   if(is_cfg_valid()) {
     ser_dev = _config.ser_dev;
   }
-  reg_add(DEV_SER_START, ser_dev, DEV_SER_END, ops);
+  reg_add(DEV_SER_START, ser_dev, DEV_SER_END, ops, REG_OPS_LEN(ops));
 }
 
 
@@ -30,14 +30,21 @@
 
 #include <avr/io.h>
 #include "config.h"
+#include "crc.h"
 #include "spi.h"
 
+/* smallest divisor a card's CSD may select, boards that were tested */
+/* with a faster SPI clock can define a lower one in config.h */
+#ifndef SPI_DIVISOR_MIN
+#  define SPI_DIVISOR_MIN SPI_DIVISOR_FAST
+#endif
+
 /* interrupts disabled, SPI enabled, MSB first, master mode */
 /* leading edge rising, sample on leading edge, clock bits cleared */
 #define SPCR_VAL 0b01010000
 
 /* set up SPSR+SPCR according to the divisor */
-/* compiles to 3-4 instructions */
+/* compiles to 3-4 instructions for a constant divisor */
 static inline __attribute__((always_inline)) void spi_set_divisor(const uint8_t div) {
   if (div == 2 || div == 8 || div == 32) {
     SPSR = _BV(SPI2X);
@@ -56,25 +63,30 @@ static inline __attribute__((always_inline)) void spi_set_divisor(const uint8_t
   }
 }
 
+/* divisor used for SPI_SPEED_FAST */
+static uint8_t fast_divisor = SPI_DIVISOR_FAST;
+
 void spi_set_speed(spi_speed_t speed) {
   if (speed == SPI_SPEED_FAST) {
-    spi_set_divisor(SPI_DIVISOR_FAST);
+    spi_set_divisor(fast_divisor);
   } else {
     spi_set_divisor(SPI_DIVISOR_SLOW);
   }
 }
 
+void spi_set_fast_divisor(uint8_t div) {
+  if (div < SPI_DIVISOR_MIN)
+    div = SPI_DIVISOR_MIN;
+  fast_divisor = div;
+}
+
 void spi_init(spi_speed_t speed) {
   /* set up SPI I/O pins */
   SPI_PORT = (SPI_PORT & ~SPI_MASK) | SPI_SCK | SPI_SS | SPI_MISO;
   SPI_DDR  = (SPI_DDR  & ~SPI_MASK) | SPI_SCK | SPI_SS | SPI_MOSI;
 
   /* enable and initialize SPI */
-  if (speed == SPI_SPEED_FAST) {
-    spi_set_divisor(SPI_DIVISOR_FAST);
-  } else {
-    spi_set_divisor(SPI_DIVISOR_SLOW);
-  }
+  spi_set_speed(speed);
 
   /* Clear buffers, just to be sure */
   (void) SPSR;
@@ -96,21 +108,80 @@ uint8_t spi_rx_byte(void) {
   return spi_exchange_byte(0xff);
 }
 
-void spi_exchange_block(void *vdata, unsigned int length, uint8_t write) {
+/* The block loops below start the next byte as soon as the SPI unit */
+/* has finished the current one and handle the data while it shifts.  */
+
+void spi_tx_block(const void *vdata, unsigned int length) {
+  const uint8_t *data = (const uint8_t*)vdata;
+  uint8_t next;
+
+  if (!length)
+    return;
+  SPDR = *data++;
+  while (--length) {
+    next = *data++;
+    loop_until_bit_is_set(SPSR, SPIF);
+    SPDR = next;
+  }
+  loop_until_bit_is_set(SPSR, SPIF);
+  (void) SPDR;
+}
+
+void spi_rx_block(void *vdata, unsigned int length) {
   uint8_t *data = (uint8_t*)vdata;
+  uint8_t tmp;
 
-  while (length--) {
-    if (!write)
-      SPDR = *data;
-    else
-      SPDR = 0xff;
+  if (!length)
+    return;
+  SPDR = 0xff;
+  while (--length) {
+    loop_until_bit_is_set(SPSR, SPIF);
+    tmp = SPDR;
+    SPDR = 0xff;
+    *data++ = tmp;
+  }
+  loop_until_bit_is_set(SPSR, SPIF);
+  *data = SPDR;
+}
 
+uint16_t spi_tx_block_crc(const void *vdata, unsigned int length) {
+  const uint8_t *data = (const uint8_t*)vdata;
+  uint16_t crc = 0;
+  uint8_t next;
+
+  if (!length)
+    return crc;
+  next = *data++;
+  SPDR = next;
+  while (--length) {
+    crc = crc_xmodem_update(crc, next);
+    next = *data++;
     loop_until_bit_is_set(SPSR, SPIF);
+    SPDR = next;
+  }
+  crc = crc_xmodem_update(crc, next);
+  loop_until_bit_is_set(SPSR, SPIF);
+  (void) SPDR;
+  return crc;
+}
 
-    if (write)
-      *data = SPDR;
-    else
-      (void) SPDR;
-    data++;
+uint16_t spi_rx_block_crc(void *vdata, unsigned int length) {
+  uint8_t *data = (uint8_t*)vdata;
+  uint16_t crc = 0;
+  uint8_t tmp;
+
+  if (!length)
+    return crc;
+  SPDR = 0xff;
+  while (--length) {
+    loop_until_bit_is_set(SPSR, SPIF);
+    tmp = SPDR;
+    SPDR = 0xff;
+    *data++ = tmp;
+    crc = crc_xmodem_update(crc, tmp);
   }
+  loop_until_bit_is_set(SPSR, SPIF);
+  tmp = SPDR;
+  *data = tmp;
+  return crc_xmodem_update(crc, tmp);
 }
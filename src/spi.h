@@ -117,23 +117,25 @@ static inline void spi_select_device(spi_device_t dev) {
 /* Transmit a single byte */
 void spi_tx_byte(uint8_t data);
 
-/* Exchange a data block - internal API only! */
-void spi_exchange_block(void *data, unsigned int length, uint8_t write);
+/* Transmit a data block */
+void spi_tx_block(const void *data, unsigned int length);
 
-/* Receive a data block */
-static inline void spi_tx_block(const void *data, unsigned int length) {
-  spi_exchange_block((void *)data, length, 0);
-}
+/* Transmit a data block, returns its XMODEM CRC */
+uint16_t spi_tx_block_crc(const void *data, unsigned int length);
 
 /* Receive a single byte */
 uint8_t spi_rx_byte(void);
 
 /* Receive a data block */
-static inline void spi_rx_block(void *data, unsigned int length) {
-  spi_exchange_block(data, length, 1);
-}
+void spi_rx_block(void *data, unsigned int length);
+
+/* Receive a data block, returns its XMODEM CRC */
+uint16_t spi_rx_block_crc(void *data, unsigned int length);
 
 /* Switch speed of SPI interface */
 void spi_set_speed(spi_speed_t speed);
 
+/* Set the divisor for SPI_SPEED_FAST, limited to SPI_DIVISOR_MIN */
+void spi_set_fast_divisor(uint8_t div);
+
 #endif
@@ -86,6 +86,23 @@ static inline tick_t getticks(void) {
 
 #define HZ 100
 
+/// Current time in timer 0 counts, only differences are meaningful.
+/// A compare match that the tick interrupt has not handled yet is
+/// counted here, so the result never runs backwards.
+static inline uint16_t gettimer(void) {
+  uint16_t t;
+  uint8_t  c;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    t = ticks;
+    c = TCNT0;
+    if (TIFR0 & _BV(OCF0A)) {
+      t++;
+      c = TCNT0;
+    }
+  }
+  return t * (OCR0A + 1) + c;
+}
+
 #define MS_TO_TICKS(x) (x/10)
 
 /* Adapted from Linux 2.6 include/linux/jiffies.h:
@@ -0,0 +1,3 @@
+#ifndef ARDUINO
+   #include "trace.cpp"
+#endif
@@ -0,0 +1,91 @@
+/*
+    HEXTIr-SD - Texas Instruments HEX-BUS SD Mass Storage Device
+    Copyright Jim Brain and RETRO Innovations, 2017
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    trace.cpp: In-RAM trace of Hex Bus transactions
+
+    Every PAB we handle leaves one record in a small ring buffer.
+    The byte counters are bumped from the bus transfer functions,
+    everything else is filled in once at the start and end of the
+    handler, so recording stays cheap enough not to disturb timing.
+*/
+
+#include <string.h>
+#include <avr/io.h>
+#include <util/atomic.h>
+
+#include "config.h"
+#include "timer.h"
+#include "trace.h"
+
+#ifdef CONFIG_HEXBUS_TRACE  // To hide it from Arduino IDE
+
+#if TRACE_RECORDS & (TRACE_RECORDS - 1)
+#  error "TRACE_RECORDS must be a power of 2"
+#endif
+
+trace_rec_t trace_cur;
+static trace_rec_t trace_ring[TRACE_RECORDS];
+static uint8_t trace_head;    // next record to write
+static uint8_t trace_count;   // records held
+
+/*
+   trace_start() -
+   begin a record for the 9 byte PAB that was just received.
+*/
+void trace_start(const uint8_t *pab) {
+  trace_cur.start = getticks();
+  memcpy(trace_cur.pab, pab, sizeof(trace_cur.pab));
+  trace_cur.bytes_in = 0;
+  trace_cur.bytes_out = 0;
+  trace_cur.status = TRACE_NO_STATUS;
+  trace_cur.duration = gettimer();
+}
+
+/*
+   trace_end() -
+   close the current record and add it to the ring,
+   dropping the oldest one if it is full.
+*/
+void trace_end(void) {
+  trace_cur.duration = gettimer() - trace_cur.duration;
+  trace_ring[trace_head] = trace_cur;
+  trace_head = (trace_head + 1) & (TRACE_RECORDS - 1);
+  if (trace_count < TRACE_RECORDS)
+    trace_count++;
+}
+
+/*
+   trace_dump() -
+   copy as many held records as fit in max bytes into buf, oldest
+   first, and drop them from the ring.  The rest stay for the next
+   dump.  returns the number of bytes stored.
+*/
+uint8_t trace_dump(uint8_t *buf, uint16_t max) {
+  uint8_t i = (trace_head - trace_count) & (TRACE_RECORDS - 1);
+  uint8_t len = 0;
+
+  while (trace_count && len + sizeof(trace_rec_t) <= max) {
+    memcpy(buf, &trace_ring[i], sizeof(trace_rec_t));
+    buf += sizeof(trace_rec_t);
+    len += sizeof(trace_rec_t);
+    i = (i + 1) & (TRACE_RECORDS - 1);
+    trace_count--;
+  }
+  return len;
+}
+
+#endif
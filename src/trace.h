@@ -0,0 +1,78 @@
+/*
+    HEXTIr-SD - Texas Instruments HEX-BUS SD Mass Storage Device
+    Copyright Jim Brain and RETRO Innovations, 2017
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+    trace.h: In-RAM trace of Hex Bus transactions
+
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#include "config.h"
+
+#ifdef CONFIG_HEXBUS_TRACE
+
+#define TRACE_RECORDS     8     // must be a power of 2
+#define TRACE_NO_STATUS   0xff  // no response was sent
+
+/**
+ * struct trace_rec_s - one handled transaction
+ * @start     : getticks() when the PAB arrived
+ * @pab       : the PAB as received (dev, cmd, lun, record, buflen, datalen)
+ * @bytes_in  : data bytes received after the PAB
+ * @bytes_out : bytes sent in the response frame
+ * @status    : status byte of the response, or TRACE_NO_STATUS
+ * @duration  : handler run time in timer 0 counts (1024 / F_CPU each)
+ *
+ * Records are dumped in this binary form, oldest first, 18 bytes each.
+ */
+typedef struct trace_rec_s {
+  uint16_t  start;
+  uint8_t   pab[9];
+  uint16_t  bytes_in;
+  uint16_t  bytes_out;
+  uint8_t   status;
+  uint16_t  duration;
+} trace_rec_t;
+
+extern trace_rec_t trace_cur;
+
+#define trace_in(len)     do { trace_cur.bytes_in += (len); } while(0)
+#define trace_out(len)    do { trace_cur.bytes_out += (len); } while(0)
+#define trace_status(rc)  do { trace_cur.status = (rc); } while(0)
+
+void trace_start(const uint8_t *pab);
+void trace_end(void);
+uint8_t trace_dump(uint8_t *buf, uint16_t max);
+
+#else
+
+#  define trace_in(len)     do {} while(0)
+#  define trace_out(len)    do {} while(0)
+#  define trace_status(rc)  do {} while(0)
+#  define trace_start(pab)  do {} while(0)
+#  define trace_end()       do {} while(0)
+
+#endif
+
+#ifdef __cplusplus
+} // extern "C"
+#endif
+#endif